@@ -0,0 +1,122 @@
+# Generates C++ source with OpenCL programs embedded as byte arrays.
+#
+# Run in script mode:
+#   cmake -DOCL_DIR=<dir with *.cl> -DOUTPUT=<file.cpp>
+#         [-DOCLC=<oclc executable> -DOCL_BUILD_OPTIONS=<options> -DBINARY_DIR=<dir>]
+#         -P embed_ocl.cmake
+#
+# Lines #include "<file>" of programs are replaced by <file> of OCL_DIR, so
+# helpers shared by several programs (ocl/common) are kept in one place and
+# every embedded program is self-contained.
+#
+# If OCLC is given, every program is precompiled by oclc for all OpenCL
+# devices of the build machine and the resulting program cache entries are
+# embedded too. Failure of oclc (no OpenCL runtime, no devices) is not an
+# error, library will compile programs from embedded sources at run time.
+
+macro(append_embedded_file variable array_name name file)
+    file(READ ${file} file_content HEX)
+    string(LENGTH "${file_content}" hex_length)
+    math(EXPR file_size "${hex_length} / 2")
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," file_content "${file_content}")
+
+    set(${variable} "${${variable}}const unsigned char ${array_name}[] = {${file_content}0x00};\n")
+    set(embedded_entries "${embedded_entries}    {\"${name}\", ${array_name}, ${file_size}},\n")
+endmacro(append_embedded_file)
+
+file(GLOB ocl_programs "${OCL_DIR}/*.cl")
+list(SORT ocl_programs)
+
+# programs with includes expanded are written beside OUTPUT
+get_filename_component(output_dir ${OUTPUT} PATH)
+set(expanded_dir ${output_dir}/ocl)
+file(MAKE_DIRECTORY ${expanded_dir})
+
+set(ocl_sources "")
+foreach(ocl_program ${ocl_programs})
+    get_filename_component(ocl_program_name ${ocl_program} NAME)
+    file(READ ${ocl_program} program_content)
+
+    string(REGEX MATCHALL "#include \"[^\"]+\"" includes "${program_content}")
+    foreach(include ${includes})
+        string(REGEX REPLACE "#include \"([^\"]+)\"" "\\1" included_name "${include}")
+        file(READ ${OCL_DIR}/${included_name} included_content)
+        string(REPLACE "${include}" "${included_content}" program_content "${program_content}")
+    endforeach(include)
+
+    file(WRITE ${expanded_dir}/${ocl_program_name} "${program_content}")
+
+    list(APPEND ocl_sources ${expanded_dir}/${ocl_program_name})
+endforeach(ocl_program)
+
+if (OCLC)
+    file(REMOVE_RECURSE ${BINARY_DIR})
+    file(MAKE_DIRECTORY ${BINARY_DIR})
+
+    foreach(ocl_source ${ocl_sources})
+        execute_process(COMMAND ${OCLC} -a -b "${OCL_BUILD_OPTIONS}" -o ${BINARY_DIR} ${ocl_source}
+                        RESULT_VARIABLE oclc_result
+                        OUTPUT_QUIET ERROR_QUIET)
+        if (NOT oclc_result EQUAL 0)
+            get_filename_component(ocl_source_name ${ocl_source} NAME)
+            message(STATUS "oclc could not precompile ${ocl_source_name}, it will be built at run time")
+        endif (NOT oclc_result EQUAL 0)
+    endforeach(ocl_source)
+
+    file(GLOB ocl_binaries "${BINARY_DIR}/*.bin")
+    list(SORT ocl_binaries)
+endif (OCLC)
+
+set(arrays "")
+set(embedded_entries "")
+set(index 0)
+foreach(ocl_source ${ocl_sources})
+    get_filename_component(ocl_source_name ${ocl_source} NAME)
+    append_embedded_file(arrays ocl_source_${index} ${ocl_source_name} ${ocl_source})
+    math(EXPR index "${index} + 1")
+endforeach(ocl_source)
+set(source_entries "${embedded_entries}")
+
+set(embedded_entries "")
+set(index 0)
+foreach(ocl_binary ${ocl_binaries})
+    get_filename_component(ocl_binary_name ${ocl_binary} NAME)
+    append_embedded_file(arrays ocl_binary_${index} ${ocl_binary_name} ${ocl_binary})
+    math(EXPR index "${index} + 1")
+endforeach(ocl_binary)
+set(binary_entries "${embedded_entries}")
+
+file(WRITE ${OUTPUT}.tmp
+"// Generated by covc/embed_ocl.cmake. Do not edit.
+
+#include \"oclsources.h\"
+
+#include <string.h>
+
+namespace
+{
+
+${arrays}
+} // namespace
+
+const EmbeddedFile embedded_ocl_sources[] = {
+${source_entries}    {0, 0, 0}
+};
+
+const EmbeddedFile embedded_ocl_binaries[] = {
+${binary_entries}    {0, 0, 0}
+};
+
+const EmbeddedFile * find_embedded_ocl_source(const char * name)
+{
+    for (const EmbeddedFile * file = embedded_ocl_sources; file->name; ++file)
+        if (strcmp(file->name, name) == 0)
+            return file;
+
+    return 0;
+}
+")
+
+# touch output only if it changed, so library is not recompiled in vain
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
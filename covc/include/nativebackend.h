@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NATIVEBACKEND_H
+#define NATIVEBACKEND_H
+
+#include "threadpool.h"
+
+#include <memory>
+#include <vector>
+
+//! how colors of hypotheses are compared, the same values as of
+//! VoxelColorer::ColorMetric
+enum NativeColorMetric
+{
+    NATIVE_COLOR_METRIC_NORMALIZED_RGB,
+    NATIVE_COLOR_METRIC_SQUARED_DISTANCE,
+    NATIVE_COLOR_METRIC_CHROMATICITY,
+    NATIVE_COLOR_METRIC_CIELAB,
+    NATIVE_COLOR_METRIC_VARIANCE
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//! Everything the voxel coloring steps read. Filled by VoxelColorer.
+///////////////////////////////////////////////////////////////////////////////
+struct NativeScene
+{
+    //! dimensions of resulting voxel cube by x, y, z
+    size_t dimensions[3];
+
+    //! bounding box. elements: pos_x, pos_y, pos_z, size_x, size_y, size_z;
+    const float * bounding_box;
+
+    //! images in ARGB. size = width*height*number_of_images*4
+    const unsigned char * pixels;
+    size_t width, height;
+    size_t number_of_images;
+
+    //! matrices. size of each = number_of_images*16
+    const float * projection_matrices;
+    const float * unprojection_matrices;
+    const float * image_calibration_matrices;
+
+    float threshold;
+    NativeColorMetric color_metric;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//! Host implementation of steps 1-4.
+//!
+//! Every step is a port of the kernel with the same name from covc/ocl: the
+//! same algorithm on the same hypotheses layout. Results may differ from the
+//! OpenCL path in the last bits of float math (kernels are built with
+//! -cl-mad-enable and use device builtins). Views are always checked one by
+//! one with colors converted on the fly: batched views, consistency by
+//! voxels and precomputed chromaticities are modes of the OpenCL path only.
+///////////////////////////////////////////////////////////////////////////////
+class NativeBackend
+{
+public:
+    NativeBackend();
+    ~NativeBackend();
+
+public:
+    void build_voxel_model(const NativeScene & scene, unsigned char * voxel_model);
+    void calculate_threshold_histogram(const NativeScene & scene, const std::vector<float> & thresholds, unsigned int * histogram);
+    void prepare(size_t number_of_threads = 0);
+
+    // getters
+    size_t get_number_of_threads() const {return thread_pool.get() ? thread_pool->get_number_of_threads() : 0;}
+
+private:
+    void run_step_1();
+    void run_step_2();
+    void run_step_2_3(unsigned int * iteration_info);
+    void run_step_3(unsigned int * iteration_info);
+    void run_step_3_for_image(size_t current_image_number);
+    void run_step_4(unsigned char * voxel_model);
+
+    size_t number_of_voxels() const {return scene.dimensions[0]*scene.dimensions[1]*scene.dimensions[2];}
+
+private:
+    std::unique_ptr<ThreadPool> thread_pool;
+
+    NativeScene scene;
+
+    //! the same layout as hypotheses buffer of OpenCL path:
+    //! (1 + number_of_images) uchar4 per voxel
+    std::vector<unsigned char> hypotheses;
+
+    //! voxel index of the first visible voxel for every pixel of every image
+    std::vector<int> z_buffer;
+
+    //! per pixel result of consistency check of current image
+    std::vector<unsigned char> consistency;
+};
+
+#endif // NATIVEBACKEND_H
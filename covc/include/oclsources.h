@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OCLSOURCES_H
+#define OCLSOURCES_H
+
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//! File embedded into covclib at build time (see covc/embed_ocl.cmake).
+///////////////////////////////////////////////////////////////////////////////
+struct EmbeddedFile
+{
+    const char * name;
+    const unsigned char * data;
+    size_t size;
+};
+
+//! sources of ocl/*.cl. the last element has name == 0
+extern const EmbeddedFile embedded_ocl_sources[];
+
+//! program cache entries precompiled by oclc. the last element has name == 0
+extern const EmbeddedFile embedded_ocl_binaries[];
+
+const EmbeddedFile * find_embedded_ocl_source(const char * name);
+
+#endif // OCLSOURCES_H
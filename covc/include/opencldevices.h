@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OPENCLDEVICES_H
+#define OPENCLDEVICES_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "cl.hpp"
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//! OpenCL device as seen by voxel colorer
+///////////////////////////////////////////////////////////////////////////////
+struct OpenCLDevice
+{
+    cl::Platform platform;
+    cl::Device device;
+
+    std::string platform_name;
+    std::string name;
+    std::string vendor;
+    std::string driver_version;
+
+    cl_device_type type;
+    cl_uint compute_units;
+    cl_uint max_clock_frequency;
+    cl_ulong global_memory_size;
+    bool image_support;
+
+    //! estimation of device speed. 0 - device can't run voxel colorer
+    double score;
+};
+
+OpenCLDevice describe_opencl_device(const cl::Device & device);
+std::vector<OpenCLDevice> get_opencl_devices();
+double score_opencl_device(const OpenCLDevice & device);
+std::vector<cl::Device> split_opencl_device_by_numa(const cl::Device & device);
+
+#endif // OPENCLDEVICES_H
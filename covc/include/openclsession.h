@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OPENCLSESSION_H
+#define OPENCLSESSION_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "cl.hpp"
+
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//! Device buffers of voxel colorer which live between build_voxel_model()
+//! calls.
+//!
+//! reserve() reallocates a buffer only if it is too small for the scene,
+//! so jobs of the same shape run without any allocation on the device.
+//!
+//! All scenes of a batch share the buffers: voxel grids are stacked by z,
+//! per scene data (bounding box, matrices, views) is stored scene after
+//! scene.
+//!
+//! Images are kept in chunks of a few views, each chunk is a separate image,
+//! so step 1 can work on a chunk while the next one is uploaded.
+///////////////////////////////////////////////////////////////////////////////
+class OpenCLSession
+{
+public:
+    enum SessionBuffer
+    {
+        BUFFER_DIMENSIONS,
+        BUFFER_BOUNDING_BOX,
+        BUFFER_PROJECTION_MATRICES,
+        BUFFER_UNPROJECTION_MATRICES,
+        BUFFER_IMAGE_CALIBRATION_MATRICES,
+        BUFFER_HYPOTHESES,
+        BUFFER_CHROMATICITIES,
+        BUFFER_ITERATION_INFO,
+        BUFFER_VISIBLE_VOXELS,
+        BUFFER_LIST_SIZES,
+        BUFFER_Z_BUFFER,
+        BUFFER_Z_DEPTH,
+        BUFFER_REJECTIONS,
+        BUFFER_VIEWS_OF_VOXELS,
+        BUFFER_OCCUPANCY,
+        BUFFER_VOXEL_MODEL,
+        NUMBER_OF_BUFFERS
+    };
+
+    //! iteration info holds one slot per step 3 iteration in flight, each is
+    //! number of consistent hypotheses, number of visible voxels, changed
+    //! flag and padding
+    static const size_t max_iterations_in_flight = 3;
+    static const size_t iteration_info_size = 4;
+
+    //! visible voxels of a slab are listed twice: the list being read and the
+    //! one being written. list sizes are followed by sums of work groups of
+    //! the compaction
+    static const size_t number_of_lists = 2;
+
+    //! occupancy holds one byte per brick of brick_size^3 voxels,
+    //! passed to ocl/ programs as BRICK_SIZE
+    static const size_t brick_size = 4;
+
+public:
+    OpenCLSession();
+
+public:
+    void release();
+    static size_t get_number_of_bricks(const size_t * dimensions);
+
+    void reserve(const cl::Context & context,
+                 const size_t * dimensions,
+                 size_t number_of_scenes,
+                 size_t number_of_images,
+                 size_t width,
+                 size_t height,
+                 bool chromaticities);
+
+    // getters
+    cl::Buffer & get_buffer(SessionBuffer buffer) {return buffers[buffer];}
+    cl::Image3D & get_image_chunk(size_t chunk) {return image_chunks[chunk];}
+    size_t get_chunk_of_image(size_t image) const;
+    size_t get_first_image_of_chunk(size_t chunk) const {return first_images[chunk];}
+    size_t get_number_of_image_chunks() const {return image_chunks.size();}
+    size_t get_number_of_images_in_chunk(size_t chunk) const {return first_images[chunk + 1] - first_images[chunk];}
+    size_t get_number_of_allocations() const {return number_of_allocations;}
+
+private:
+    void reserve_buffer(SessionBuffer buffer, size_t size);
+
+private:
+    cl::Context context;
+
+    cl::Buffer buffers[NUMBER_OF_BUFFERS];
+    size_t capacities[NUMBER_OF_BUFFERS];
+
+    //! images of all views of all scenes, ARGB. chunk i holds views
+    //! [first_images[i], first_images[i + 1])
+    std::vector<cl::Image3D> image_chunks;
+    std::vector<size_t> first_images;
+    size_t images_width, images_height;
+
+    //! number of device allocations since session start, for statistics
+    size_t number_of_allocations;
+};
+
+#endif // OPENCLSESSION_H
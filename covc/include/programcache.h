@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "cl.hpp"
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//! Builds OpenCL programs and keeps their binaries on disk.
+//!
+//! A cached binary is keyed by platform, device, driver version, build
+//! options and hash of the source, so any change of them causes rebuild.
+//! Entries built in advance (see tools/oclc) can be added with
+//! add_prebuilt(), they are looked up before the disk.
+///////////////////////////////////////////////////////////////////////////////
+class ProgramCache
+{
+public:
+    ProgramCache();
+
+public:
+    void add_prebuilt(const unsigned char * entry, size_t size);
+    cl::Program build(const cl::Context & context,
+                      const cl::Device & device,
+                      const std::string & source,
+                      const std::string & options);
+    void store(const cl::Device & device,
+               const std::string & source,
+               const std::string & options,
+               const cl::Program & program) const;
+
+    // setters
+    void set_directory(const std::string & _directory) {directory = _directory;}
+
+    // getters
+    const std::string & get_directory() const {return directory;}
+
+    static std::string default_directory();
+    static std::string key(const cl::Device & device,
+                           const std::string & source,
+                           const std::string & options);
+
+private:
+    cl::Program build_from_binary(const cl::Context & context,
+                                  const cl::Device & device,
+                                  const std::string & binary,
+                                  const std::string & options);
+    cl::Program build_from_source(const cl::Context & context,
+                                  const cl::Device & device,
+                                  const std::string & source,
+                                  const std::string & options);
+    bool load(const std::string & key, std::string & binary) const;
+    void save(const std::string & key, const cl::Device & device, const cl::Program & program) const;
+
+private:
+    //! directory with cached binaries. empty - cache is disabled
+    std::string directory;
+
+    //! entries in cache file format, not owned
+    std::vector<std::pair<const unsigned char *, size_t> > prebuilt_entries;
+};
+
+#endif // PROGRAMCACHE_H
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//! Fixed set of worker threads executing "for each task index" jobs.
+//!
+//! The calling thread takes part in every job, so a pool created for
+//! N threads starts N-1 workers.
+///////////////////////////////////////////////////////////////////////////////
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t number_of_threads = 0);
+    ~ThreadPool();
+
+public:
+    void run(size_t number_of_tasks, const std::function<void (size_t)> & task);
+
+    // getters
+    size_t get_number_of_threads() const {return workers.size() + 1;}
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool & operator = (const ThreadPool &);
+
+    void execute_tasks();
+    void worker();
+
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable job_started;
+    std::condition_variable job_finished;
+
+    //! current job
+    const std::function<void (size_t)> * task;
+    size_t number_of_tasks;
+    std::atomic<size_t> next_task;
+
+    //! number of workers which still execute current job
+    size_t number_of_busy_workers;
+
+    //! incremented for every new job, so workers can't miss or repeat one
+    size_t job_number;
+
+    bool stop;
+};
+
+#endif // THREADPOOL_H
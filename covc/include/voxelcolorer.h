@@ -27,8 +27,36 @@
 
 #include "cl.hpp"
 
+#include "nativebackend.h"
+#include "opencldevices.h"
+#include "openclsession.h"
+#include "programcache.h"
+
+#include <future>
+
 class VoxelColorer
 {
+public:
+    //! where steps of the algorithm are executed
+    enum Backend
+    {
+        BACKEND_AUTO,       //!< OpenCL if it is available, native otherwise
+        BACKEND_OPENCL,
+        BACKEND_NATIVE      //!< host threads, no OpenCL needed
+    };
+
+    //! how colors of hypotheses are compared with threshold. kernels are
+    //! specialized for the metric in prepare(). values are the same as of
+    //! NativeColorMetric
+    enum ColorMetric
+    {
+        COLOR_METRIC_NORMALIZED_RGB,    //!< distance of normalized colors
+        COLOR_METRIC_SQUARED_DISTANCE,  //!< the same without square root
+        COLOR_METRIC_CHROMATICITY,      //!< distance of chromaticities, intensity is ignored
+        COLOR_METRIC_CIELAB,            //!< CIE76 delta E, threshold is in its units
+        COLOR_METRIC_VARIANCE           //!< distance from mean color of voxel
+    };
+
 public:
     VoxelColorer();
     ~VoxelColorer();
@@ -37,61 +65,183 @@ public:
 public:
     void add_image(const unsigned char * image, size_t width, size_t height, const float * image_calibration_matrix);
     bool build_voxel_model();
+    std::future<bool> build_voxel_model_async();
+    bool build_voxel_models(const std::vector<VoxelColorer *> & scenes);
     std::vector<unsigned char> & get_voxel_model() {return voxel_model;}
     bool prepare();
+    bool sweep_thresholds(const std::vector<float> & thresholds, std::vector<unsigned int> & iteration_infos);
 
     // setters
+    void set_backend(Backend _backend) {backend = _backend;}
+    void set_batched_views(bool _batched_views) {batched_views = _batched_views;}
     void set_camera_calibration_matrix(const float * _camera_calibration_matrix);
+    void set_color_metric(ColorMetric _color_metric) {color_metric = _color_metric;}
+    void set_consistency_by_voxels(bool _consistency_by_voxels) {consistency_by_voxels = _consistency_by_voxels;}
+    void set_device(const cl::Device & device);
+    void set_device_auto();
+    void set_devices(const std::vector<cl::Device> & devices);
     void set_number_of_images(const size_t _number_of_images);
+    void set_precomputed_chromaticities(bool _precomputed_chromaticities) {precomputed_chromaticities = _precomputed_chromaticities;}
+    void set_program_cache_directory(const std::string & directory) {program_cache.set_directory(directory);}
     void set_resulting_voxel_cube_dimensions(size_t dimension_x, size_t dimension_y, size_t dimension_z);
+    void set_threshold(float _threshold) {threshold = _threshold;}
 
     // getters
+    Backend get_backend() const {return backend;}
+    ColorMetric get_color_metric() const {return color_metric;}
     const cl::Context get_context () const  {return ocl_context;}
+    const cl::Device get_device () const    {return ocl_slabs.empty() ? cl::Device() : ocl_slabs[0].device;}
+    size_t get_number_of_device_allocations() const;
+    float get_threshold() const {return threshold;}
+
+    static std::vector<OpenCLDevice> get_devices() {return get_opencl_devices();}
+    static std::vector<cl::Device> split_device_by_numa(const cl::Device & device) {return split_opencl_device_by_numa(device);}
+
+private:
+    //! OpenCL programs, one per file in ocl/
+    enum OpenCLProgram
+    {
+        PROGRAM_STEP_1,
+        PROGRAM_STEP_2,
+        PROGRAM_STEP_2_3,
+        PROGRAM_COMPACTION,
+        PROGRAM_STEP_3,
+        PROGRAM_OCCUPANCY,
+        PROGRAM_STEP_4,
+        NUMBER_OF_PROGRAMS
+    };
+
+    //! everything bound to one device. every device works on its own slab
+    //! of voxel grid: slices [first_slice, last_slice) by z
+    struct DeviceSlab
+    {
+        cl::Device device;
+        cl::CommandQueue command_queue;
+
+        //! images are uploaded here, so upload runs beside kernels
+        cl::CommandQueue transfer_queue;
+
+        //! programs built in prepare()
+        cl::Program programs[NUMBER_OF_PROGRAMS];
+
+        //! buffers reused by every build of a batch
+        OpenCLSession session;
+
+        //! commands the next enqueued command depends on
+        std::vector<cl::Event> events;
+
+        //! uploads of views streamed by add_image(), one per view
+        std::vector<cl::Event> image_events;
+
+        //! share of voxel grid is proportional to score
+        double score;
+        size_t first_slice, last_slice;
+
+        //! bound of size of list of visible voxels of the slab, kernels over
+        //! the list are run for so many voxels. set after step 2
+        size_t max_visible_voxels;
+    };
 
 private:
-    void build_program(cl::Program & program, const std::string & path_to_file_with_program);
+    bool build_batch(const std::vector<VoxelColorer *> & batch);
+    bool build_voxel_model_native(VoxelColorer & scene);
+    void build_program(DeviceSlab & slab, OpenCLProgram program);
+    void build_programs();
     void calculate_bounding_box();
     void calculate_projection_matrix();
+    void calculate_scene_parameters();
     void calculate_unprojection_matrices();
+    void calculate_slabs();
+    NativeScene get_native_scene() const;
+    std::string get_program_build_options() const;
+    bool has_same_shape(const VoxelColorer & scene) const;
+    void merge_z_buffers(size_t first_image, size_t images_per_launch);
     bool prepare_opencl();
+    void release_staging();
+    bool start_batch(const std::vector<VoxelColorer *> & batch);
+    bool stream_image(const unsigned char * image);
 
-    void run_step_1(cl::Buffer & bounding_box_buffer,
-                    cl::Buffer & projection_matrices_buffer,
-                    cl::Buffer & hypotheses_buffer,
-                    cl::Buffer & dimensions_buffer);
+    void enqueue_kernel(DeviceSlab & slab, const cl::Kernel & kernel,
+                        size_t first_slice, size_t last_slice,
+                        size_t items_per_voxel = 1, const cl::NDRange & local = cl::NullRange);
+    void enqueue_kernel(DeviceSlab & slab, const cl::Kernel & kernel,
+                        const cl::NDRange & global, const cl::NDRange & local = cl::NullRange);
+    void enqueue_read_buffer(DeviceSlab & slab, const cl::Buffer & buffer, size_t offset, size_t size, void * data);
+    void enqueue_compaction(DeviceSlab & slab, cl_uint list, cl_uint previous_iteration);
+    void enqueue_occupancy(cl_uint iteration);
+    void enqueue_step_2_3(size_t iteration, cl_uint previous_iteration, cl_uint list);
+    void enqueue_write_buffer(DeviceSlab & slab, const cl::Buffer & buffer, size_t offset, size_t size, const void * data);
+    void wait_for_slabs();
 
-    void run_step_2(cl::Buffer & hypotheses_buffer,
-                    cl::Buffer & dimensions_buffer,
-                    cl::KernelFunctor & func_step_2_3_first,
-                    cl::KernelFunctor & func_step_2_3_second,
-                    cl::Buffer & number_of_consistent_hypotheses_buffer,
-                    unsigned int * number_of_consistent_hypotheses);
+    void run_step_1();
+    void run_step_2(unsigned int * iteration_info);
+    void run_step_2_3(unsigned int * iteration_info);
+    void run_step_3(unsigned int * iteration_info);
+    void run_step_4();
+    void run_threshold_sweep(const std::vector<float> & thresholds, unsigned int * histogram);
 
 
-    void build_step_2_3(cl::Buffer & hypotheses_buffer,
-                        cl::Buffer & dimensions_buffer,
-                        cl::Buffer & number_of_consistent_hypotheses_buffer,
-                        cl::KernelFunctor & func_step_2_3_first,
-                        cl::KernelFunctor & func_step_2_3_second);
+private:
+    Backend backend;
+    NativeBackend native_backend;
 
-    void build_clear_z_buffer(cl::Kernel & kernel);
-    void clear_z_buffer(cl::Kernel & kernel, cl::Buffer & z_buffer);
+    cl::Context ocl_context;
 
-    void run_step_3(cl::Buffer & hypotheses_buffer,
-                    cl::Buffer & bounding_box_buffer,
-                    cl::Buffer & dimensions_buffer,
-                    cl::Buffer & projection_matrices_buffer,
-                    cl::KernelFunctor & func_step_2_3_first,
-                    cl::KernelFunctor & func_step_2_3_second,
-                    cl::Buffer & number_of_consistent_hypotheses_buffer,
-                    unsigned int * number_of_consistent_hypotheses);
+    //! devices set by set_device() or set_devices(). empty - device is
+    //! chosen by score in prepare()
+    std::vector<cl::Device> pinned_devices;
 
-    void run_step_4(cl::Buffer & hypotheses_buffer, cl::Buffer & dimensions_buffer);
+    //! devices prepared by prepare(), one slab each
+    std::vector<DeviceSlab> ocl_slabs;
 
+    ProgramCache program_cache;
 
-private:
-    cl::Context ocl_context;
-    cl::CommandQueue ocl_command_queue;
+    //! step 1 stores color coordinates of every hypothesis packed in 32 bits,
+    //! steps 2 and 3 compare them instead of converting colors. set by
+    //! set_precomputed_chromaticities(), programs are built with it in prepare()
+    bool precomputed_chromaticities;
+    bool ocl_chromaticities;
+
+    //! step 3 traces and checks all views by one launch each instead of
+    //! view after view. set by set_batched_views()
+    bool batched_views;
+
+    //! step 3 checks every visible voxel once, with all views which see it,
+    //! instead of every pixel. views are traced as batched then. set by
+    //! set_consistency_by_voxels()
+    bool consistency_by_voxels;
+
+    //! set by set_color_metric(), programs are built with it in prepare()
+    ColorMetric color_metric;
+
+    //! scenes built by current OpenCL run. all have the same shape, their
+    //! voxel grids are stacked by z in this order
+    std::vector<VoxelColorer *> ocl_batch;
+
+    //! number of slices by z of all scenes of the batch
+    size_t number_of_slices;
+
+    //! list of visible voxels of every slab left by step 3, see
+    //! OpenCLSession::BUFFER_VISIBLE_VOXELS
+    cl_uint ocl_visible_voxels_list;
+
+    //! dimensions as kernels take them. member, because they are written to
+    //! device without waiting
+    cl_uint ocl_dimensions[3];
+
+    //! pinned memory add_image() copies images to, when OpenCL is prepared.
+    //! slots are used in turn, so the next image is copied while the
+    //! previous one is uploaded
+    cl::Buffer ocl_staging_buffers[2];
+    unsigned char * ocl_staging_pointers[2];
+    std::vector<cl::Event> ocl_staging_events[2];
+    size_t ocl_staging_size;
+
+    //! z buffers of images of current launch traced by every slab and the
+    //! merged one
+    std::vector<int> slab_z_buffers;
+    std::vector<int> slab_z_depths;
+    std::vector<int> merged_z_buffer;
 
     //! dimensions of resulting voxel cube by x, y, z
     size_t dimensions[3];
@@ -103,8 +253,12 @@ private:
     //! Info about images
     ///////////////////////////////////////////////////////////////////////////
     //! images. number of pixels = width*height*number_of_images*3*size_of(color)
+    //! empty if images are streamed to devices
     std::vector<unsigned char> pixels;
 
+    //! images were streamed to devices of this voxel colorer by add_image()
+    bool images_on_devices;
+
     //! image dimensions
     size_t width, height;
 
@@ -116,10 +270,10 @@ private:
 
     //! projection matrices for images
     //! size = number_of_images*16*size_of(float)
-    std::vector<std::vector<float> > projection_matrices;
-    std::vector<std::vector<float> > unprojection_matrices;
+    std::vector<float> projection_matrices;
+    std::vector<float> unprojection_matrices;
 
-    std::vector<std::vector<float> > image_calibration_matrices;
+    std::vector<float> image_calibration_matrices;
     ///////////////////////////////////////////////////////////////////////////
     //! End of info about images
     ///////////////////////////////////////////////////////////////////////////
@@ -134,8 +288,8 @@ private:
     //  _
     // |_| - voxel visibility
     // |_| - number of consistent hypoteses on previous iteration
-    // |_| - empty
-    // |_| - empty
+    // |_| - hypotheses are checked again by the next iteration of step 3
+    // |_| - voxel is seen by new pixels at current iteration of step 3
     // |_|-
     // |_| \
     // ...  - hypotheses
@@ -146,8 +300,6 @@ private:
 
     //! threshold.
     float threshold;
-    float step_size;
-    float precision;
 };
 
 #endif // VOXELCOLORER_H
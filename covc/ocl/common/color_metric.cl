@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// included by programs of steps 1, 2 and 3, see covc/embed_ocl.cmake
+
+// color consistency metric, chosen by build options. hypotheses are compared
+// by their coordinates in color space of the metric:
+//  default                         distance of normalized colors
+//  COVC_METRIC_SQUARED_DISTANCE    the same without square root
+//  COVC_METRIC_CHROMATICITY        chromaticities r/(r + g + b), g/(r + g + b),
+//                                  b/(r + g + b), squared distance
+//  COVC_METRIC_CIELAB              squared CIE76 delta E. sRGB curve is
+//                                  approximated by gamma 2
+//  COVC_METRIC_VARIANCE            normalized colors, squared distance of
+//                                  hypothesis from mean color of the voxel
+// threshold is always a distance, squared metrics compare with its square.
+// empty hypothesis has infinite coordinates, so it is close to nothing.
+#if defined(COVC_METRIC_SQUARED_DISTANCE) || defined(COVC_METRIC_CHROMATICITY) || \
+    defined(COVC_METRIC_CIELAB) || defined(COVC_METRIC_VARIANCE)
+#define SQUARED_COLOR_DIFFERENCE
+#endif
+
+float4 color_coordinates (uchar4 color)
+{
+    if ((color.x + color.y + color.z + color.w) == 0)
+        return (float4)(INFINITY);
+
+#if defined(COVC_METRIC_CHROMATICITY)
+    float4 rgb = convert_float4(color);
+    return rgb/(rgb.x + rgb.y + rgb.z);
+#elif defined(COVC_METRIC_CIELAB)
+    float4 rgb = convert_float4(color)*(1.0f/255.0f);
+    rgb *= rgb;
+
+    // D65 white point
+    float3 xyz = (float3)(dot(rgb.xyz, (float3)(0.4124f, 0.3576f, 0.1805f))/0.9505f,
+                          dot(rgb.xyz, (float3)(0.2126f, 0.7152f, 0.0722f)),
+                          dot(rgb.xyz, (float3)(0.0193f, 0.1192f, 0.9505f))/1.0890f);
+    float3 f = select(cbrt(xyz), 7.787f*xyz + 16.0f/116.0f, isless(xyz, (float3)(0.008856f)));
+
+    return (float4)(116.0f*f.y - 16.0f, 500.0f*(f.x - f.y), 200.0f*(f.y - f.z), 0.0f);
+#else
+    return normalize(convert_float4(color));
+#endif
+}
+
+float color_difference (float4 a, float4 b)
+{
+#ifdef SQUARED_COLOR_DIFFERENCE
+    float4 d = a - b;
+    return dot(d, d);
+#else
+    return distance(a, b);
+#endif
+}
+
+float color_threshold (float threshold)
+{
+#ifdef SQUARED_COLOR_DIFFERENCE
+    return threshold*threshold;
+#else
+    return threshold;
+#endif
+}
+
+int is_empty_color (float4 coordinates)
+{
+    return isinf(coordinates.w);
+}
+
+// color coordinates of hypotheses written by step 1 if COVC_CHROMATICITIES
+// is defined, 32 bits per hypothesis:
+//  normalized colors   coordinates are not negative and of unit length, so
+//                      the largest one is restored from the other two. they
+//                      are at most 1/sqrt(2) and kept in 15 bits, top bits
+//                      hold index of the largest one
+//  chromaticities      r and g in 16 bits, b = 1 - r - g
+//  CIELAB              L in 10 bits, a and b in 11 bits
+// none of them is all ones, which stands for empty hypothesis
+ushort2 pack_color_coordinates (float4 coordinates)
+{
+    if (is_empty_color(coordinates))
+        return (ushort2)(USHRT_MAX);
+
+#if defined(COVC_METRIC_CHROMATICITY)
+    return convert_ushort2_sat_rte(coordinates.xy*65535.0f);
+#elif defined(COVC_METRIC_CIELAB)
+    uint l = min(convert_uint_sat_rte(coordinates.x*(1022.0f/100.0f)), 1022u);
+    uint2 ab = min(convert_uint2_sat_rte((coordinates.yz + 128.0f)*(2047.0f/256.0f)), (uint2)(2047u));
+
+    return as_ushort2((l << 22) | (ab.x << 11) | ab.y);
+#else
+    uint largest = coordinates.x >= coordinates.y ? (coordinates.x >= coordinates.z ? 0 : 2) :
+                                                    (coordinates.y >= coordinates.z ? 1 : 2);
+    float2 kept = largest == 0 ? coordinates.yz : (largest == 1 ? coordinates.xz : coordinates.xy);
+
+    ushort2 packed = min(convert_ushort2_sat_rte(kept*(32767.0f*1.41421356f)), (ushort2)(32767));
+    packed.x |= (ushort)((largest & 1) << 15);
+    packed.y |= (ushort)((largest >> 1) << 15);
+
+    return packed;
+#endif
+}
+
+float4 unpack_color_coordinates (ushort2 packed)
+{
+    if (packed.x == USHRT_MAX && packed.y == USHRT_MAX)
+        return (float4)(INFINITY);
+
+#if defined(COVC_METRIC_CHROMATICITY)
+    float2 rg = convert_float2(packed)*(1.0f/65535.0f);
+
+    return (float4)(rg, 1.0f - rg.x - rg.y, 0.0f);
+#elif defined(COVC_METRIC_CIELAB)
+    uint lab = as_uint(packed);
+
+    return (float4)((float)(lab >> 22)*(100.0f/1022.0f),
+                    (float)((lab >> 11) & 2047u)*(256.0f/2047.0f) - 128.0f,
+                    (float)(lab & 2047u)*(256.0f/2047.0f) - 128.0f,
+                    0.0f);
+#else
+    uint largest = (packed.x >> 15) | ((packed.y >> 15) << 1);
+    float2 kept = convert_float2(packed & (ushort2)(32767))*(1.0f/(32767.0f*1.41421356f));
+    float restored = sqrt(max(1.0f - dot(kept, kept), 0.0f));
+
+    return largest == 0 ? (float4)(restored, kept, 0.0f) :
+           largest == 1 ? (float4)(kept.x, restored, kept.y, 0.0f) :
+                          (float4)(kept, restored, 0.0f);
+#endif
+}
+
+// coordinates of hypothesis of image of voxel. taken from chromaticities
+// written by step 1 if COVC_CHROMATICITIES is defined. chromaticities hold
+// number_of_images entries per voxel, there is none for voxel header
+float4 hypothesis_color_coordinates (uint voxel_index,
+                                     uint image,
+                                     uint number_of_images,
+                                     __global uchar * hypotheses,
+                                     __global ushort2 * chromaticities)
+{
+#ifdef COVC_CHROMATICITIES
+    return unpack_color_coordinates(chromaticities[voxel_index*number_of_images + image]);
+#else
+    return color_coordinates(vload4(voxel_index*(1 + number_of_images) + 1 + image, hypotheses));
+#endif
+}
+
+void reject_hypothesis (uint voxel_index,
+                        uint image,
+                        uint number_of_images,
+                        __global uchar * hypotheses,
+                        __global ushort2 * chromaticities)
+{
+    vstore4((uchar4)(0), voxel_index*(1 + number_of_images) + 1 + image, hypotheses);
+
+#ifdef COVC_CHROMATICITIES
+    chromaticities[voxel_index*number_of_images + image] = (ushort2)(USHRT_MAX);
+#endif
+}
@@ -20,21 +20,17 @@
  * THE SOFTWARE.
  */
 
-#define width   512
-#define height  512
+// included by programs of steps 2 and 3, see covc/embed_ocl.cmake
 
-__kernel void
-clear_z_buffer (__global int * z_buffer)
-{
-    uint z = get_global_id(0);
-    uint number_of_images = get_global_size(0);
-
-    for (uint x = 0; x < width; ++x)
-        for (uint y = 0; y < height; ++y)
-        {
-            uint z_buffer_offset = x + y*width + z*width*height;
-
-            z_buffer[z_buffer_offset] = -1;
-        }
+// iteration info of every iteration of step 3 in flight is 4 uints: number
+// of consistent hypotheses, number of visible voxels, changed flag, unused.
+// host enqueues iterations ahead, so an iteration enqueued after the one which
+// changed nothing has nothing to do
+#define ITERATION_INFO_SIZE     4
+#define NO_PREVIOUS_ITERATION   UINT_MAX
 
+bool is_converged (__global __const uint * iteration_info, uint previous_iteration)
+{
+    return previous_iteration != NO_PREVIOUS_ITERATION &&
+           iteration_info[previous_iteration*ITERATION_INFO_SIZE + 2] == 0;
 }
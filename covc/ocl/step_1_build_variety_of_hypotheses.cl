@@ -37,50 +37,95 @@ float4 mul_mat_vec (float16 mat, float4 vec)
 
 uint is_in_image(float4 pos, float4 box)
 {
-    if (isless(pos.x, box.x) || isgreater(pos.x, box.z) ||
-        isless(pos.y, box.y) || isgreater(pos.y, box.w) )
-        return 0;
+    // written without negation, so NaN position is not in image
+    if (isgreaterequal(pos.x, box.x) && isless(pos.x, box.z) &&
+        isgreaterequal(pos.y, box.y) && isless(pos.y, box.w) )
+        return 1;
 
-    return 1;
+    return 0;
 }
 
+#include "common/color_metric.cl"
+
+// hypothesis is written with its packed color coordinates if
+// COVC_CHROMATICITIES is defined, so consistency checks of steps 2 and 3
+// don't convert the same hypothesis again and again
+void store_hypothesis (uchar4 color,
+                       uint voxel_index,
+                       uint image,
+                       uint number_of_images,
+                       __global uchar * hypotheses,
+                       __global ushort2 * chromaticities)
+{
+    vstore4(color, voxel_index*(1 + number_of_images) + 1 + image, hypotheses);
+
+#ifdef COVC_CHROMATICITIES
+    chromaticities[voxel_index*number_of_images + image] = pack_color_coordinates(color_coordinates(color));
+#endif
+}
+
+// voxel grids of all scenes of a batch are stacked by z: slice z belongs to
+// scene z / dimensions[2]. views of scene s are [s*number_of_images,
+// (s + 1)*number_of_images) in projection matrices and images.
+//
+// images holds views [first_image, first_image + number_of_images_in_chunk),
+// so views can be processed as soon as their chunk is uploaded. voxel header
+// is written with the chunk holding the first view of the scene.
+//
+// chromaticities holds number_of_images entries per voxel, see
+// pack_color_coordinates. it may be null if COVC_CHROMATICITIES is not
+// defined.
 __kernel void
 build_variety_of_hypotheses (__global __const float * bounding_box,
                             __read_only image3d_t images,
                             __global float16 * projection_matrices,
                             __global uchar * hypotheses,
                             __global __const uint * dimensions,
-                            uint number_of_images)
+                            uint number_of_images,
+                            uint first_image,
+                            uint number_of_images_in_chunk,
+                            __global ushort2 * chromaticities)
 {
     uint4 voxel_pos = (uint4) (get_global_id(0), get_global_id(1), get_global_id(2), 0);
 
-    float4 voxel_pos_3d = (float4) ((float)bounding_box[0] + ((float)voxel_pos.x + 0.5f)*((float)bounding_box[3]/(float)dimensions[0]),
-                                    (float)bounding_box[1] + ((float)voxel_pos.y + 0.5f)*((float)bounding_box[4]/(float)dimensions[1]),
-                                    (float)bounding_box[2] + ((float)voxel_pos.z + 0.5f)*((float)bounding_box[5]/(float)dimensions[2]),
+    uint scene = voxel_pos.z / dimensions[2];
+    uint scene_z = voxel_pos.z - scene*dimensions[2];
+    __global __const float * scene_bounding_box = bounding_box + scene*6;
+
+    float4 voxel_pos_3d = (float4) ((float)scene_bounding_box[0] + ((float)voxel_pos.x + 0.5f)*((float)scene_bounding_box[3]/(float)dimensions[0]),
+                                    (float)scene_bounding_box[1] + ((float)voxel_pos.y + 0.5f)*((float)scene_bounding_box[4]/(float)dimensions[1]),
+                                    (float)scene_bounding_box[2] + ((float)scene_z + 0.5f)*((float)scene_bounding_box[5]/(float)dimensions[2]),
                                      1.0f);
 
     int width = get_image_width(images);
     int height = get_image_height(images);
 
 
-    __const uint hypotheses_offset = voxel_pos.x*(1 + number_of_images) +
-                                     voxel_pos.y*dimensions[0]*(1 + number_of_images) +
-                                     voxel_pos.z*dimensions[0]*dimensions[1]*(1 + number_of_images);
+    __const uint voxel_index = voxel_pos.x +
+                               voxel_pos.y*dimensions[0] +
+                               voxel_pos.z*dimensions[0]*dimensions[1];
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
+
+    __const uint first_view_of_scene = scene*number_of_images;
 
     // set voxel visible and non zero number of consists hypotheses
-    vstore4((uchar4)(1, UCHAR_MAX, 0, 0), hypotheses_offset, hypotheses);
+    if (first_view_of_scene >= first_image && first_view_of_scene < first_image + number_of_images_in_chunk)
+        vstore4((uchar4)(1, UCHAR_MAX, 0, 0), hypotheses_offset, hypotheses);
 
-    for (uint i = 0; i < number_of_images; ++i)
+    uint first_view = max(first_image, first_view_of_scene);
+    uint last_view = min(first_image + number_of_images_in_chunk, first_view_of_scene + number_of_images);
+
+    for (uint view = first_view; view < last_view; ++view)
     {
-        float4 pos_at_image_3d = mul_mat_vec(projection_matrices[i], voxel_pos_3d);
-        float4 pos_at_image = (float4) (pos_at_image_3d.x/pos_at_image_3d.z, pos_at_image_3d.y/pos_at_image_3d.z, i, 0);
+        float4 pos_at_image_3d = mul_mat_vec(projection_matrices[view], voxel_pos_3d);
+        float4 pos_at_image = (float4) (pos_at_image_3d.x/pos_at_image_3d.z, pos_at_image_3d.y/pos_at_image_3d.z, view - first_image, 0);
 
-        uint hypothesis_offset = hypotheses_offset + 1 + i;
+        uint image = view - first_view_of_scene;
 
-        if (is_in_image(pos_at_image, (float4)(0.0f, 0.0f, convert_float(width), convert_float(height))))
+        if (!is_in_image(pos_at_image, (float4)(0.0f, 0.0f, convert_float(width), convert_float(height))))
         {
             //if voxel not projected in image
-            vstore4((uchar4)(0), hypothesis_offset, hypotheses);
+            store_hypothesis((uchar4)(0), voxel_index, image, number_of_images, hypotheses, chromaticities);
         }
         else
         {
@@ -91,9 +136,24 @@ build_variety_of_hypotheses (__global __const float * bounding_box,
             color.w = 0;
 
             if (color.x < 10 && color.y < 10 && color.z < 10)
-                vstore4((uchar4)(0), hypothesis_offset, hypotheses);
+                store_hypothesis((uchar4)(0), voxel_index, image, number_of_images, hypotheses, chromaticities);
             else
-                vstore4((uchar4)(color.x, color.y, color.z, 0), hypothesis_offset, hypotheses);
+                store_hypothesis((uchar4)(color.x, color.y, color.z, 0), voxel_index, image, number_of_images, hypotheses, chromaticities);
         }
     }
 }
+
+// make voxels invisible. used for slices of the grid processed by other
+// devices, so rays pass through them and they are not counted in
+// iteration info
+__kernel void
+hide_voxels (__global uchar * hypotheses,
+             __global __const uint * dimensions,
+             uint number_of_images)
+{
+    __const uint hypotheses_offset = get_global_id(0)*(1 + number_of_images) +
+                                     get_global_id(1)*dimensions[0]*(1 + number_of_images) +
+                                     get_global_id(2)*dimensions[0]*dimensions[1]*(1 + number_of_images);
+
+    vstore4((uchar4)(0), hypotheses_offset, hypotheses);
+}
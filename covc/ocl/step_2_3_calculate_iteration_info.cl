@@ -20,39 +20,136 @@
  * THE SOFTWARE.
  */
 
+
+#include "common/iteration_info.cl"
+
+// list of visible voxels of the slab, see step_2_3_compact_visible_voxels.cl
+#define NO_LIST                 UINT_MAX
+
+uint number_of_candidates (uint number_of_voxels,
+                           __global __const uint * list_sizes,
+                           uint list)
+{
+    return list == NO_LIST ? number_of_voxels : list_sizes[list];
+}
+
+uint candidate_voxel (uint candidate,
+                      uint first_voxel,
+                      uint number_of_voxels,
+                      __global __const uint * voxels,
+                      uint list)
+{
+    return list == NO_LIST ? first_voxel + candidate : voxels[list*number_of_voxels + candidate];
+}
+
+// recount consistent hypotheses of voxels of list or of all voxels
+// [first_voxel, first_voxel + number_of_voxels) of the stacked grid if list
+// is NO_LIST, hide voxels without them and sum
+// number of consistent hypotheses and number of visible voxels, all in one
+// pass over voxel headers. one work item per voxel, global size is rounded
+// up to a multiple of local size, which is a power of two, from a bound of
+// the number of voxels. work group sums
+// its voxels in local memory and adds the sums to info of the iteration,
+// which must be zeroed before. changed flag is set if any voxel is changed.
 __kernel void
 calculate_iteration_info (__global uchar * hypotheses,
-                          __global __const uint * dimensions,
                           uint number_of_images,
-                          __global __write_only uint * number_of_consistent_hypotheses)
+                          uint first_voxel,
+                          uint number_of_voxels,
+                          __global __const uint * voxels,
+                          __global __const uint * list_sizes,
+                          uint list,
+                          __global uint * iteration_info,
+                          uint iteration,
+                          uint previous_iteration,
+                          __local uint * local_hypotheses,
+                          __local uint * local_voxels)
 {
+    // the same for all work items, so barriers below are reached by all or none
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    __global uint * info = iteration_info + iteration*ITERATION_INFO_SIZE;
+
+    uint local_id = get_local_id(0);
+    uint candidate = get_global_id(0);
+
     uint hypotheses_result = 0;
     uint voxels_result = 0;
 
-    uint hypotheses_size = 1 + number_of_images;
-
-    for (uint x = 0; x < dimensions[0]; ++x)
+    if (candidate < number_of_candidates(number_of_voxels, list_sizes, list))
     {
-        for (uint y = 0; y < dimensions[1]; ++y)
+        uint voxel = candidate_voxel(candidate, first_voxel, number_of_voxels, voxels, list);
+        uint hypothesis_offset = voxel*(1 + number_of_images);
+
+        // if voxel is visible
+        uchar4 voxel_info = vload4(hypothesis_offset, hypotheses);
+
+        if (voxel_info.x != 0)
         {
-            for (uint z = 0; z < dimensions[2]; ++z)
+            uchar consistent_hypotheses = 0;
+
+            for (uint i = 0; i < number_of_images; ++i)
             {
-                uint hypothesis_offset = x*hypotheses_size +
-                                         y*dimensions[0]*hypotheses_size +
-                                         z*dimensions[0]*dimensions[1]*hypotheses_size;
+                uchar4 color = vload4(hypothesis_offset + 1 + i, hypotheses);
 
-                // if voxel is visible
-                uchar4 voxel_info = vload4(hypothesis_offset, hypotheses);
+                // if hypothesis is consistent
+                if ((color.x + color.y + color.z + color.w) != 0)
+                    consistent_hypotheses++;
+            }
 
-                if (voxel_info.x != 0)
+            if (consistent_hypotheses == 0)
+            {
+                // make voxel invisible
+                vstore4((uchar4)(0), hypothesis_offset, hypotheses);
+                info[2] = 1;
+            }
+            else
+            {
+                // if number of consistent hypotheses at previos step
+                // is not equal to number of consistent hypothises at this step
+                uchar changed = voxel_info.y != consistent_hypotheses;
+                if (changed)
+                    info[2] = 1;
+
+                // hypotheses of the voxel are checked again at the next
+                // iteration if some of them were rejected or the voxel was
+                // seen by new pixels at this one
+                uchar dirty = changed || voxel_info.w != 0;
+
+                if (changed || voxel_info.z != dirty || voxel_info.w != 0)
                 {
-                    hypotheses_result += voxel_info.y;
-                    voxels_result++;
+                    voxel_info.y = consistent_hypotheses;
+                    voxel_info.z = dirty;
+                    voxel_info.w = 0;
+                    vstore4(voxel_info, hypothesis_offset, hypotheses);
                 }
+
+                hypotheses_result = consistent_hypotheses;
+                voxels_result = 1;
             }
         }
     }
 
-    number_of_consistent_hypotheses[0] = hypotheses_result;
-    number_of_consistent_hypotheses[1] = voxels_result;
+    local_hypotheses[local_id] = hypotheses_result;
+    local_voxels[local_id] = voxels_result;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint stride = get_local_size(0)/2; stride > 0; stride /= 2)
+    {
+        if (local_id < stride)
+        {
+            local_hypotheses[local_id] += local_hypotheses[local_id + stride];
+            local_voxels[local_id] += local_voxels[local_id + stride];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        atomic_add(info, local_hypotheses[0]);
+        atomic_add(info + 1, local_voxels[0]);
+    }
 }
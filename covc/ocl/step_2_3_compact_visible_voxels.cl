@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "common/iteration_info.cl"
+
+// every slab keeps two lists of its visible voxels, each of number_of_voxels
+// indices in voxels: the current one and the next one. list_sizes holds
+// sizes of both lists, then sums of work groups of the compaction.
+// NO_LIST stands for all voxels [first_voxel, first_voxel + number_of_voxels)
+// of the slab.
+#define NUMBER_OF_LISTS         2
+#define NO_LIST                 UINT_MAX
+
+uint number_of_candidates (uint number_of_voxels,
+                           __global __const uint * list_sizes,
+                           uint list)
+{
+    return list == NO_LIST ? number_of_voxels : list_sizes[list];
+}
+
+uint candidate_voxel (uint candidate,
+                      uint first_voxel,
+                      uint number_of_voxels,
+                      __global __const uint * voxels,
+                      uint list)
+{
+    return list == NO_LIST ? first_voxel + candidate : voxels[list*number_of_voxels + candidate];
+}
+
+// inclusive prefix sum of values of work group, local size is a power of two
+void scan_work_group (__local uint * values, uint local_id, uint local_size)
+{
+    for (uint offset = 1; offset < local_size; offset *= 2)
+    {
+        uint value = local_id >= offset ? values[local_id - offset] : 0;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        values[local_id] += value;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// the first pass of compaction of list into the other one: number of visible
+// voxels among candidates of every work group. one work item per candidate,
+// global size is rounded up to a multiple of local size, which is a power of
+// two, from a bound of the number of candidates.
+__kernel void
+count_visible_voxels (__global __const uchar * hypotheses,
+                      uint number_of_images,
+                      uint first_voxel,
+                      uint number_of_voxels,
+                      __global __const uint * voxels,
+                      __global uint * list_sizes,
+                      uint list,
+                      __global __const uint * iteration_info,
+                      uint previous_iteration,
+                      __local uint * local_counts)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    uint local_id = get_local_id(0);
+    uint candidate = get_global_id(0);
+
+    uint visible = 0;
+
+    if (candidate < number_of_candidates(number_of_voxels, list_sizes, list))
+    {
+        uint voxel = candidate_voxel(candidate, first_voxel, number_of_voxels, voxels, list);
+        visible = vload4(voxel*(1 + number_of_images), hypotheses).x != 0;
+    }
+
+    local_counts[local_id] = visible;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint stride = get_local_size(0)/2; stride > 0; stride /= 2)
+    {
+        if (local_id < stride)
+            local_counts[local_id] += local_counts[local_id + stride];
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+        list_sizes[NUMBER_OF_LISTS + get_group_id(0)] = local_counts[0];
+}
+
+// the second pass: sums of work groups are replaced by their offsets in the
+// output list, which receives the total as its size. run by one work group,
+// which goes through the sums local size at a time.
+__kernel void
+scan_visible_voxels (__global uint * list_sizes,
+                     uint output_list,
+                     uint number_of_work_groups,
+                     __global __const uint * iteration_info,
+                     uint previous_iteration,
+                     __local uint * local_sums)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    __global uint * work_group_sums = list_sizes + NUMBER_OF_LISTS;
+
+    uint local_id = get_local_id(0);
+    uint local_size = get_local_size(0);
+
+    uint total = 0;
+
+    for (uint first = 0; first < number_of_work_groups; first += local_size)
+    {
+        uint work_group = first + local_id;
+        uint sum = work_group < number_of_work_groups ? work_group_sums[work_group] : 0;
+
+        local_sums[local_id] = sum;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        scan_work_group(local_sums, local_id, local_size);
+
+        if (work_group < number_of_work_groups)
+            work_group_sums[work_group] = total + local_sums[local_id] - sum;
+
+        total += local_sums[local_size - 1];
+
+        // the sums are overwritten by the next chunk
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+        list_sizes[output_list] = total;
+}
+
+// the third pass: visible voxels are written to the output list in the order
+// of candidates. must be run with the same sizes as count_visible_voxels.
+__kernel void
+write_visible_voxels (__global __const uchar * hypotheses,
+                      uint number_of_images,
+                      uint first_voxel,
+                      uint number_of_voxels,
+                      __global uint * voxels,
+                      __global __const uint * list_sizes,
+                      uint list,
+                      uint output_list,
+                      __global __const uint * iteration_info,
+                      uint previous_iteration,
+                      __local uint * local_offsets)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    uint local_id = get_local_id(0);
+    uint candidate = get_global_id(0);
+
+    uint voxel = 0;
+    uint visible = 0;
+
+    if (candidate < number_of_candidates(number_of_voxels, list_sizes, list))
+    {
+        voxel = candidate_voxel(candidate, first_voxel, number_of_voxels, voxels, list);
+        visible = vload4(voxel*(1 + number_of_images), hypotheses).x != 0;
+    }
+
+    local_offsets[local_id] = visible;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    scan_work_group(local_offsets, local_id, get_local_size(0));
+
+    if (visible)
+    {
+        uint offset = list_sizes[NUMBER_OF_LISTS + get_group_id(0)] + local_offsets[local_id] - 1;
+        voxels[output_list*number_of_voxels + offset] = voxel;
+    }
+}
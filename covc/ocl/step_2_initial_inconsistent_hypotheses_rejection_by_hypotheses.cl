@@ -20,43 +20,84 @@
  * THE SOFTWARE.
  */
 
+#include "common/color_metric.cl"
+
+// one work item per hypothesis of every voxel: global id 0 is
+// x*number_of_images + image, global ids 1 and 2 are y and z of voxel.
+// hypotheses of a voxel are zeroed in parallel, but a hypothesis which makes
+// another one consistent is consistent itself, so the result doesn't depend
+// on order.
+//
+// mean color of COVC_METRIC_VARIANCE would see hypotheses being zeroed, so
+// with it the first work item of a voxel checks the whole voxel.
 __kernel void
 initial_inconsistent_hypotheses_rejection (__global uchar * hypotheses,
-                                           uint x, uint y, uint z,
                                            __global __const uint * dimensions,
-                                           float threshold)
+                                           uint number_of_images,
+                                           float threshold,
+                                           __global ushort2 * chromaticities)
 {
     // current hypothesis number
-    uint pos = get_global_id(0);
+    uint pos = get_global_id(0) % number_of_images;
 
-    uint number_of_images = get_global_size(0);
+    uint x = get_global_id(0) / number_of_images;
+    uint y = get_global_id(1);
+    uint z = get_global_id(2);
 
-    __const uint hypotheses_offset = x*(1 + number_of_images) +
-                                     y*dimensions[0]*(1 + number_of_images) +
-                                     z*dimensions[0]*dimensions[1]*(1 + number_of_images);
+    __const uint voxel_index = x + y*dimensions[0] + z*dimensions[0]*dimensions[1];
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
 
     // if voxel not visible
     uchar4 voxel_info = vload4(hypotheses_offset, hypotheses);
     if (voxel_info.x == 0)
         return;
 
-    uchar4 hypothesis_color = vload4(hypotheses_offset + 1 + pos, hypotheses);
+    __const float color_threshold_of_metric = color_threshold(threshold);
+
+#ifdef COVC_METRIC_VARIANCE
+    if (pos != 0)
+        return;
+
+    float4 mean = (float4)(0.0f);
+    uint number_of_colors = 0;
+    for (uint i = 0; i < number_of_images; ++i)
+    {
+        float4 coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+
+        if (!is_empty_color(coordinates))
+        {
+            mean += coordinates;
+            number_of_colors++;
+        }
+    }
+
+    if (number_of_colors != 0)
+        mean /= (float)number_of_colors;
+
+    for (uint i = 0; i < number_of_images; ++i)
+    {
+        float4 coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+
+        // the only hypothesis of voxel is not consistent with anything
+        if (!is_empty_color(coordinates) &&
+            (number_of_colors < 2 || !isless(color_difference(coordinates, mean), color_threshold_of_metric)))
+            reject_hypothesis(voxel_index, i, number_of_images, hypotheses, chromaticities);
+    }
+#else
+    float4 hypothesis_coordinates = hypothesis_color_coordinates(voxel_index, pos, number_of_images, hypotheses, chromaticities);
 
     // if hypothesis is not consist
-    if ((hypothesis_color.x + hypothesis_color.y + hypothesis_color.z + hypothesis_color.w) == 0)
+    if (is_empty_color(hypothesis_coordinates))
         return;
 
     uint consistent = 0;
     for (uint i = 0; i < number_of_images && consistent == 0; ++i)
     {
-        uint current_offset = hypotheses_offset + 1 + i;
-
         // if it is not the same hypothesis
         if (i != pos)
         {
-            uchar4 color = vload4(current_offset, hypotheses);
-
-            if(isless( distance( normalize(convert_float4(color)), normalize(convert_float4(hypothesis_color))), threshold))
+            if (isless(color_difference(hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities), hypothesis_coordinates),
+                       color_threshold_of_metric))
                 consistent = 1;
         }
     }
@@ -64,6 +105,198 @@ initial_inconsistent_hypotheses_rejection (__global uchar * hypotheses,
     // hypothesis is not consistent
     if (consistent == 0)
     {
-        vstore4((uchar4)(0), hypotheses_offset + 1 + pos, hypotheses);
+        reject_hypothesis(voxel_index, pos, number_of_images, hypotheses, chromaticities);
+    }
+#endif
+}
+
+// the same as initial_inconsistent_hypotheses_rejection, but a work group
+// takes whole voxels: local size by x is a multiple of number_of_images.
+// hypotheses of the voxels are read once and staged in local memory as
+// color coordinates, so every comparison is made in local memory. all
+// hypotheses are staged before any is rejected, so every metric works on
+// a snapshot of the voxel.
+__kernel void
+initial_inconsistent_hypotheses_rejection_local (__global uchar * hypotheses,
+                                                 __global __const uint * dimensions,
+                                                 uint number_of_images,
+                                                 float threshold,
+                                                 __global ushort2 * chromaticities,
+                                                 __local float4 * staged_coordinates)
+{
+    // current hypothesis number
+    uint pos = get_global_id(0) % number_of_images;
+
+    uint x = get_global_id(0) / number_of_images;
+    uint y = get_global_id(1);
+    uint z = get_global_id(2);
+
+    // hypotheses of current voxel in local memory
+    __local float4 * voxel_coordinates = staged_coordinates + get_local_id(0) - pos;
+
+    __const uint voxel_index = x + y*dimensions[0] + z*dimensions[0]*dimensions[1];
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
+
+    uchar4 voxel_info = vload4(hypotheses_offset, hypotheses);
+
+    float4 coordinates = hypothesis_color_coordinates(voxel_index, pos, number_of_images, hypotheses, chromaticities);
+    voxel_coordinates[pos] = coordinates;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // if voxel not visible or hypothesis is not consist
+    if (voxel_info.x == 0 || is_empty_color(coordinates))
+        return;
+
+    __const float color_threshold_of_metric = color_threshold(threshold);
+
+#ifdef COVC_METRIC_VARIANCE
+    float4 mean = (float4)(0.0f);
+    uint number_of_colors = 0;
+    for (uint i = 0; i < number_of_images; ++i)
+    {
+        if (!is_empty_color(voxel_coordinates[i]))
+        {
+            mean += voxel_coordinates[i];
+            number_of_colors++;
+        }
+    }
+
+    uint consistent = number_of_colors > 1 &&
+                      isless(color_difference(coordinates, mean/(float)number_of_colors), color_threshold_of_metric);
+#else
+    uint consistent = 0;
+    for (uint i = 0; i < number_of_images && consistent == 0; ++i)
+    {
+        // if it is not the same hypothesis
+        if (i != pos && isless(color_difference(voxel_coordinates[i], coordinates), color_threshold_of_metric))
+            consistent = 1;
+    }
+#endif
+
+    // hypothesis is not consistent
+    if (consistent == 0)
+        reject_hypothesis(voxel_index, pos, number_of_images, hypotheses, chromaticities);
+}
+
+// threshold sweep. one work item per voxel, nothing is rejected. step 2
+// keeps a hypothesis if its smallest difference to another hypothesis of the
+// voxel (difference from mean color for COVC_METRIC_VARIANCE) is less than
+// threshold, and keeps a voxel if it keeps any of its hypotheses. so the
+// hypothesis goes to bin of the first of ascending thresholds which keeps
+// it, voxel goes to the first bin of its hypotheses. bin number_of_thresholds
+// is for those kept by none.
+//
+// histogram holds number_of_thresholds + 1 bins of hypotheses, then the same
+// of voxels. local_histogram is the same size if local_bins is set, work
+// group sums its counts there first. otherwise the bins don't fit local
+// memory and counts go to histogram directly.
+void count_in_bin (uint bin,
+                   __global uint * histogram,
+                   __local uint * local_histogram,
+                   uint local_bins)
+{
+    if (local_bins)
+        atomic_inc(local_histogram + bin);
+    else
+        atomic_inc(histogram + bin);
+}
+
+__kernel void
+calculate_threshold_histogram (__global uchar * hypotheses,
+                               __global __const uint * dimensions,
+                               uint number_of_images,
+                               __global ushort2 * chromaticities,
+                               __global __const float * thresholds,
+                               uint number_of_thresholds,
+                               __global uint * histogram,
+                               __local uint * local_histogram,
+                               uint local_bins)
+{
+    __const uint number_of_bins = 2*(number_of_thresholds + 1);
+
+    // work group may be of any shape
+    __const uint local_id = get_local_id(0) + get_local_size(0)*(get_local_id(1) + get_local_size(1)*get_local_id(2));
+    __const uint local_size = get_local_size(0)*get_local_size(1)*get_local_size(2);
+
+    if (local_bins)
+    {
+        for (uint i = local_id; i < number_of_bins; i += local_size)
+            local_histogram[i] = 0;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
+    uint z = get_global_id(2);
+
+    __const uint voxel_index = x + y*dimensions[0] + z*dimensions[0]*dimensions[1];
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
+
+    // if voxel is visible
+    if (vload4(hypotheses_offset, hypotheses).x != 0)
+    {
+#ifdef COVC_METRIC_VARIANCE
+        float4 mean = (float4)(0.0f);
+        uint number_of_colors = 0;
+        for (uint i = 0; i < number_of_images; ++i)
+        {
+            float4 coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+
+            if (!is_empty_color(coordinates))
+            {
+                mean += coordinates;
+                number_of_colors++;
+            }
+        }
+
+        if (number_of_colors != 0)
+            mean /= (float)number_of_colors;
+#endif
+
+        uint voxel_bin = number_of_thresholds;
+
+        for (uint pos = 0; pos < number_of_images; ++pos)
+        {
+            float4 hypothesis_coordinates = hypothesis_color_coordinates(voxel_index, pos, number_of_images, hypotheses, chromaticities);
+
+            // if hypothesis is not consist
+            if (is_empty_color(hypothesis_coordinates))
+                continue;
+
+#ifdef COVC_METRIC_VARIANCE
+            float smallest_difference = number_of_colors > 1 ? color_difference(hypothesis_coordinates, mean) : INFINITY;
+#else
+            float smallest_difference = INFINITY;
+            for (uint i = 0; i < number_of_images; ++i)
+            {
+                if (i != pos)
+                    smallest_difference = fmin(smallest_difference,
+                                               color_difference(hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities),
+                                                                hypothesis_coordinates));
+            }
+#endif
+
+            uint bin = 0;
+            while (bin < number_of_thresholds && !isless(smallest_difference, color_threshold(thresholds[bin])))
+                bin++;
+
+            count_in_bin(bin, histogram, local_histogram, local_bins);
+            voxel_bin = min(voxel_bin, bin);
+        }
+
+        count_in_bin(number_of_thresholds + 1 + voxel_bin, histogram, local_histogram, local_bins);
+    }
+
+    if (!local_bins)
+        return;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint i = local_id; i < number_of_bins; i += local_size)
+    {
+        if (local_histogram[i] != 0)
+            atomic_add(histogram + i, local_histogram[i]);
     }
 }
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "common/iteration_info.cl"
+
+// voxel grid of every scene is split into bricks of BRICK_SIZE^3 voxels, the
+// last ones by every axis may be cut by the grid. bricks of scenes are stacked
+// by z like voxel grids, occupancy holds one byte per brick: 1 if any voxel of
+// the brick is visible. trace_z_buffer steps over empty bricks at once.
+// BRICK_SIZE is defined by build options, see
+// VoxelColorer::get_program_build_options
+
+// set occupancy of every brick, one work item per brick. voxels are only
+// carved, so after an iteration of step 3 only occupied bricks are checked
+// again and nothing is done if the iteration changed nothing.
+// NO_PREVIOUS_ITERATION - all bricks are checked
+__kernel void
+build_occupancy (__global __const uchar * hypotheses,
+                 __global __const uint * dimensions,
+                 uint number_of_images,
+                 __global uchar * occupancy,
+                 __global __const uint * iteration_info,
+                 uint iteration)
+{
+    if (is_converged(iteration_info, iteration))
+        return;
+
+    uint brick = get_global_id(0);
+
+    if (iteration != NO_PREVIOUS_ITERATION && occupancy[brick] == 0)
+        return;
+
+    uint4 grid = (uint4)(dimensions[0], dimensions[1], dimensions[2], 0);
+    uint4 bricks = (grid + BRICK_SIZE - 1)/BRICK_SIZE;
+
+    uint brick_z = brick/(bricks.x*bricks.y);
+    uint scene = brick_z/bricks.z;
+
+    uint4 first_voxel = (uint4)(brick % bricks.x,
+                                (brick / bricks.x) % bricks.y,
+                                brick_z - scene*bricks.z,
+                                0)*BRICK_SIZE;
+    uint4 last_voxel = min(first_voxel + BRICK_SIZE, grid);
+
+    uchar occupied = 0;
+
+    for (uint z = first_voxel.z; z < last_voxel.z && !occupied; ++z)
+        for (uint y = first_voxel.y; y < last_voxel.y && !occupied; ++y)
+            for (uint x = first_voxel.x; x < last_voxel.x && !occupied; ++x)
+            {
+                uint voxel_index = x + y*grid.x + (scene*grid.z + z)*grid.x*grid.y;
+
+                if (hypotheses[voxel_index*(1 + number_of_images)*4] == 1)
+                    occupied = 1;
+            }
+
+    occupancy[brick] = occupied;
+}
@@ -32,11 +32,12 @@ float4 mul_mat_vec (float16 mat, float4 vec)
 
 uint is_in_image(float4 pos, float4 box)
 {
-    if (isless(pos.x, box.x) || isgreater(pos.x, box.z) ||
-        isless(pos.y, box.y) || isgreater(pos.y, box.w) )
-        return 0;
+    // written without negation, so NaN position is not in image
+    if (isgreaterequal(pos.x, box.x) && isless(pos.x, box.z) &&
+        isgreaterequal(pos.y, box.y) && isless(pos.y, box.w) )
+        return 1;
 
-    return 1;
+    return 0;
 }
 
 float4 position_at_image(float16 projection_matrix, float4 position_in_3d)
@@ -47,6 +48,10 @@ float4 position_at_image(float16 projection_matrix, float4 position_in_3d)
     return pos_at_image;
 }
 
+#include "common/iteration_info.cl"
+
+#include "common/color_metric.cl"
+
 // intersect ray with a box
 // http://www.siggraph.org/education/materials/HyperGraph/raytrace/rtinter3.htm
 
@@ -71,188 +76,603 @@ int intersectBox(float4 r_o, float4 r_d, float4 boxmin, float4 boxmax, float *tn
     return smallest_tmax > largest_tmin;
 }
 
-// base on code from volumeRender.cl from NVIDIA GPU Computing SDK
-int4 hit_voxel (float8 bounding_box,
-                uint x, uint y, uint width, uint height,
-                float4 eyeRay_o,
-                float16 projection_matrix,
-                uint4 dimensions,
-                float step,
-                int * find_voxel)
+// bricks of BRICK_SIZE^3 voxels, see step_3_build_occupancy.cl
+
+// walk voxels of a scene grid crossed by ray from the point it enters the
+// bounding box, every voxel once (Amanatides, Woo: A Fast Voxel Traversal
+// Algorithm for Ray Tracing). voxel i of axis spans [box_min + i*voxel_size,
+// box_min + (i + 1)*voxel_size), like in the other steps. bricks without
+// visible voxels are left by one step. returns index of the first visible
+// voxel in the stacked grid or -1, number_of_steps receives number of voxels
+// crossed before it, skipped ones included.
+int trace_ray (float4 ray_origin,
+               float4 ray_direction,
+               __global __const float * bounding_box,
+               uint4 dimensions,
+               uint scene,
+               uint number_of_images,
+               __global uchar * hypotheses,
+               __global __const uchar * occupancy,
+               int * number_of_steps)
 {
-    // map to [-1, 1] coordinates
-    float u = (x / (float) width)*2.0f-1.0f;
-    float v = (y / (float) height)*2.0f-1.0f;
+    float4 box_min = (float4)(bounding_box[0], bounding_box[1], bounding_box[2], 0.0f);
+    float4 box_max = (float4)(bounding_box[0] + bounding_box[3],
+                              bounding_box[1] + bounding_box[4],
+                              bounding_box[2] + bounding_box[5],
+                              0.0f);
 
-    float4 boxMin = (float4)(bounding_box.s0, bounding_box.s1, bounding_box.s2, 1.0f);
-    float4 boxMax = (float4)(bounding_box.s0 + bounding_box.s3,
-                             bounding_box.s1 + bounding_box.s4,
-                             bounding_box.s2 + bounding_box.s5,
-                             1.0f);
+    float tnear, tfar;
+    if (!intersectBox(ray_origin, ray_direction, box_min, box_max, &tnear, &tfar) || tfar < 0.0f)
+        return -1;
+
+    // the camera may be inside the box
+    float4 entry = ray_origin + ray_direction*max(tnear, 0.0f);
+
+    float origin[3] = {ray_origin.x, ray_origin.y, ray_origin.z};
+    float direction[3] = {ray_direction.x, ray_direction.y, ray_direction.z};
+    float entry_position[3] = {entry.x, entry.y, entry.z};
+    int grid[3] = {(int)dimensions.x, (int)dimensions.y, (int)dimensions.z};
+    int bricks[3] = {(grid[0] + BRICK_SIZE - 1)/BRICK_SIZE,
+                     (grid[1] + BRICK_SIZE - 1)/BRICK_SIZE,
+                     (grid[2] + BRICK_SIZE - 1)/BRICK_SIZE};
+
+    __const uint first_slice_of_scene = scene*dimensions.z;
+    __const uint first_brick_slice_of_scene = scene*bricks[2];
+
+    int voxel[3];
+    int step[3];
+    float voxel_size[3];
+    float t_max[3];
+    float t_delta[3];
+
+    for (uint i = 0; i < 3; ++i)
+    {
+        voxel_size[i] = bounding_box[3 + i]/(float)grid[i];
 
-    // calculate eye ray in world space
-    float4 eyeRay_d;
+        // entry point lies on the box, rounding may put it a voxel outside
+        voxel[i] = clamp(convert_int_sat_rtn((entry_position[i] - bounding_box[i])/voxel_size[i]), 0, grid[i] - 1);
+        step[i] = direction[i] < 0.0f ? -1 : 1;
 
-    float4 temp = (float4)(u, v, 1.0f, 1.0f);
-    eyeRay_d = mul_mat_vec(projection_matrix, temp);
-    //eyeRay_d.w = 0.0f;
+        // ray parameter of the next voxel boundary and the distance between
+        // boundaries. axes the ray is parallel to are never crossed
+        float boundary = bounding_box[i] + (float)(voxel[i] + (step[i] > 0))*voxel_size[i];
+        t_max[i] = direction[i] != 0.0f ? (boundary - origin[i])/direction[i] : INFINITY;
+        t_delta[i] = direction[i] != 0.0f ? fabs(voxel_size[i]/direction[i]) : INFINITY;
+    }
 
-    //eyeRay_d -= eyeRay_o;
+    *number_of_steps = 0;
 
-    // find intersection with box
-    float tnear, tfar;
-    int hit = intersectBox(eyeRay_o, eyeRay_d, boxMin, boxMax, &tnear, &tfar);
-    if (!hit)
+    for (;;)
     {
-        if ((x < width) && (y < height))
+        int brick[3] = {voxel[0]/BRICK_SIZE, voxel[1]/BRICK_SIZE, voxel[2]/BRICK_SIZE};
+        int brick_index = brick[0] + brick[1]*bricks[0] + (brick[2] + (int)first_brick_slice_of_scene)*bricks[0]*bricks[1];
+
+        if (occupancy[brick_index] == 0)
         {
-            // return invalid coords
-            return (int4)(-1, -1, -1, -1);
+            // the nearest boundary of brick the ray leaves it through
+            uint axis = 0;
+            float t_exit = INFINITY;
+
+            for (uint i = 0; i < 3; ++i)
+            {
+                if (direction[i] == 0.0f)
+                    continue;
+
+                float boundary = bounding_box[i] + (float)((brick[i] + (step[i] > 0))*BRICK_SIZE)*voxel_size[i];
+                float t = (boundary - origin[i])/direction[i];
+
+                if (t < t_exit)
+                {
+                    t_exit = t;
+                    axis = i;
+                }
+            }
+
+            if (t_exit > tfar)
+                return -1;
+
+            // voxel behind the boundary by the axis and the voxel the ray
+            // leaves brick from by the other ones. it is never behind the
+            // current one, so voxels are counted as by single steps
+            for (uint i = 0; i < 3; ++i)
+            {
+                int next;
+
+                if (i == axis)
+                    next = step[i] > 0 ? (brick[i] + 1)*BRICK_SIZE : brick[i]*BRICK_SIZE - 1;
+                else
+                {
+                    next = clamp(convert_int_sat_rtn((origin[i] + direction[i]*t_exit - bounding_box[i])/voxel_size[i]),
+                                 brick[i]*BRICK_SIZE, min((brick[i] + 1)*BRICK_SIZE, grid[i]) - 1);
+                    next = step[i] > 0 ? max(next, voxel[i]) : min(next, voxel[i]);
+                }
+
+                *number_of_steps += abs(next - voxel[i]);
+                voxel[i] = next;
+
+                float boundary = bounding_box[i] + (float)(voxel[i] + (step[i] > 0))*voxel_size[i];
+                t_max[i] = direction[i] != 0.0f ? (boundary - origin[i])/direction[i] : INFINITY;
+            }
+
+            if (voxel[axis] < 0 || voxel[axis] >= grid[axis])
+                return -1;
+
+            continue;
         }
+
+        int index = voxel[0] + voxel[1]*grid[0] + (voxel[2] + (int)first_slice_of_scene)*grid[0]*grid[1];
+
+        // check is voxel visible
+        if (vload4(index*(1 + number_of_images), hypotheses).x == 1)
+            return index;
+
+        // cross the nearest boundary
+        uint axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) :
+                                          (t_max[1] < t_max[2] ? 1 : 2);
+
+        if (t_max[axis] > tfar)
+            return -1;
+
+        voxel[axis] += step[axis];
+        if (voxel[axis] < 0 || voxel[axis] >= grid[axis])
+            return -1;
+
+        t_max[axis] += t_delta[axis];
+        (*number_of_steps)++;
     }
+}
+
+// trace ray of every pixel of current image and save the first visible
+// voxel to z buffer. z_depth receives number of voxels crossed by the ray,
+// so z buffers traced by devices with different slabs of the voxel grid
+// can be merged by taking the nearest hit.
+//
+// if incremental is set, z buffer is kept from the previous iteration.
+// voxels are only carved, so only rays which saw a carved voxel are traced
+// again. voxels seen by them are marked in the fourth byte of their info.
+//
+// occupancy holds bricks of voxels with visible ones, see build_occupancy.
+//
+// the third dimension is view: images [first_image, first_image +
+// images_per_launch) of every scene of the batch. voxel grids of scenes are
+// stacked by z, z buffer and z_depth hold images of scene s at
+// [s*number_of_images, (s + 1)*number_of_images), z buffer holds voxel
+// indices in the stacked grid.
+//
+// every traced pixel is written, -1 if the ray sees nothing, so z buffers
+// are never cleared. views which are not traced yet by the iteration keep
+// earlier iterations or builds, inconsistent_voxel_rejection doesn't read
+// them.
+__kernel void
+trace_z_buffer (__global uchar * hypotheses,
+                __global __const float * bounding_box,
+                __global __const uint * dimensions,
+                __global int * z_buffer,
+                __global int * z_depth,
+                __global float16 * unprojection_matrices,
+                __global float16 * image_calibration_matrices,
+                uint first_image,
+                uint images_per_launch,
+                uint number_of_images,
+                __global __const uint * iteration_info,
+                uint previous_iteration,
+                uint incremental,
+                __global __const uchar * occupancy)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
 
-    //calculate voxel position
-    int4 voxel_position;
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
+    uint scene = get_global_id(2)/images_per_launch;
+    uint current_image_number = first_image + get_global_id(2)%images_per_launch;
+    uint width = get_global_size(0);
+    uint height = get_global_size(1);
 
-    float t = tnear + step;
+    __global __const float * scene_bounding_box = bounding_box + scene*6;
+    __const uint view = scene*number_of_images + current_image_number;
 
-    //if ray goes out from bounding volume
-    if (t > tfar)
+    // calculate offset in z buffer
+    __const uint z_buffer_offset = (uint)x +
+                                   (uint)y*width +
+                                   view*width*height;
+    __const uint z_depth_offset = z_buffer_offset;
+
+    if (incremental)
     {
-        // return invalid coords
-        return (int4)(-1, -1, -1, -1);
+        __const int previous_voxel = z_buffer[z_buffer_offset];
+
+        // the ray saw nothing or its voxel is still visible
+        if (previous_voxel == -1 ||
+            vload4(previous_voxel*(1 + number_of_images), hypotheses).x == 1)
+            return;
     }
 
-    float4 pos = eyeRay_o + eyeRay_d*t;
-    pos = pos*0.5f+0.5f;    // map position to [0, 1] coordinates
+    // map to [-1, 1] coordinates
+    float u = (x / (float) width)*2.0f-1.0f;
+    float v = (y / (float) height)*2.0f-1.0f;
+
+    float4 ray_origin = (float4)(image_calibration_matrices[view].s3,
+                                 image_calibration_matrices[view].s7,
+                                 image_calibration_matrices[view].sB,
+                                 0.0f);
+    float4 ray_direction = mul_mat_vec(unprojection_matrices[view], (float4)(u, v, 1.0f, 1.0f));
 
-    voxel_position.x = min(max((int)pos.x, 0), (int)dimensions.x-1);          //clamp((int)floor(pos.x), 0, (int)dimensions[0]-1);
-    voxel_position.y = min(max((int)pos.y, 0), (int)dimensions.y-1);
-    voxel_position.z = min(max((int)pos.z, 0), (int)dimensions.z-1);
-    voxel_position.w = 0;
+    int number_of_steps = 0;
+    int voxel_index = trace_ray(ray_origin, ray_direction, scene_bounding_box,
+                                (uint4)(dimensions[0], dimensions[1], dimensions[2], 0),
+                                scene, number_of_images, hypotheses, occupancy,
+                                &number_of_steps);
 
-    return voxel_position;
+    // if we didn't find _any_ visible voxels
+    if (voxel_index == -1)
+    {
+        z_buffer[z_buffer_offset] = -1;
+        z_depth[z_depth_offset] = INT_MAX;
+        return;
+    }
+
+    // voxel is seen by a new pixel, so its hypotheses are checked again
+    hypotheses[voxel_index*(1 + number_of_images)*4 + 3] = 1;
+
+    //save voxel index
+    z_buffer[z_buffer_offset] = voxel_index;
+    z_depth[z_depth_offset] = number_of_steps;
 }
 
+// reject hypothesis of current image for voxel seen by a pixel if no other
+// image sees the voxel in the same color. only voxels of slices
+// [first_slice, last_slice) of the stacked grid are processed, the rest
+// belong to other devices. consistent hypotheses are not written, so pixels
+// which see the same voxel don't race. the third dimension is view, like in
+// trace_z_buffer.
+//
+// if deferred is set, rejected pixels are only marked in rejections and
+// apply_rejections rejects their hypotheses after all views are checked, so
+// views of one launch see hypotheses as they were before it.
+//
+// if incremental is set, only voxels whose hypotheses were rejected at the
+// previous iteration or which are seen by new pixels are checked, the other
+// ones passed the check with the same hypotheses and z buffers.
+//
+// only views traced up to this launch are compared, z buffers of the next
+// ones hold earlier iterations or builds, or nothing yet. so a view checked
+// one by one sees the views before it, like with z buffers cleared by every
+// iteration, and z buffers need no clearing.
 __kernel void
 inconsistent_voxel_rejection ( __global uchar * hypotheses,
                                 __global __const float * bounding_box,
                                 __global __const uint * dimensions,
                                 __global int * z_buffer,
                                 __global float16 * projection_matrices,
-                                __global float16 * unprojection_matrices,
-                                __global float16 * image_calibration_matrices,
-                                uint current_image_number,
+                                uint first_image,
+                                uint images_per_launch,
                                 uint number_of_images,
                                 float threshold,
-                                float step_size)
+                                uint first_slice,
+                                uint last_slice,
+                                __global ushort2 * chromaticities,
+                                __global __const uint * iteration_info,
+                                uint previous_iteration,
+                                uint incremental,
+                                __global uchar * rejections,
+                                uint deferred)
 {
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
     uint x = get_global_id(0);
     uint y = get_global_id(1);
+    uint scene = get_global_id(2)/images_per_launch;
+    uint current_image_number = first_image + get_global_id(2)%images_per_launch;
     uint width = get_global_size(0);
     uint height = get_global_size(1);
 
-    // calculate offset in z buffer
-    __const uint z_buffer_offset = (uint)x +
-                                   (uint)y*width +
-                                   current_image_number*width*height;
+    __const uint first_view_of_scene = scene*number_of_images;
+    __const uint z_buffer_offset = x + y*width + (first_view_of_scene + current_image_number)*width*height;
 
-    uint hypotheses_offset = 0;
+    if (deferred)
+        rejections[z_buffer_offset] = 0;
 
-    int4 voxel_position;
+    __const int voxel_index = z_buffer[z_buffer_offset];
+    if (voxel_index == -1)
+        return;
 
-    // if find voxel is -1, didn't find _any_ visible voxels
-    // if find voxel is 0 , didn't hit to bounding volume
-    // if find_voxel is 1, find visible voxel
-    int find_voxel = 0;
+    uint4 voxel_position = (uint4)(voxel_index % dimensions[0],
+                                   (voxel_index / dimensions[0]) % dimensions[1],
+                                   voxel_index / (dimensions[0]*dimensions[1]),
+                                   0);
+
+    if (voxel_position.z < first_slice || voxel_position.z >= last_slice)
+        return;
 
-    // step to go inside bounding volume
-    float step = 0.0f;
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
 
-    while (find_voxel == 0)
+    if (incremental)
     {
-        voxel_position = hit_voxel((float8)(bounding_box[0], bounding_box[1], bounding_box[2], bounding_box[3],
-                                            bounding_box[4], bounding_box[5], 0.0f, 0.0f),
-                                   x, y, width, height,
-                                   (float4)(image_calibration_matrices[current_image_number].s3,
-                                            image_calibration_matrices[current_image_number].s7,
-                                            image_calibration_matrices[current_image_number].sB,
-                                            0.0f),
-                                   unprojection_matrices[current_image_number],
-                                   (uint4)(dimensions[0], dimensions[1], dimensions[2], 0),
-                                   step,
-                                   &find_voxel);
-
-        // if we didn't find _any_ visible voxels, stop process this ray
-        if (voxel_position.x == -1 && voxel_position.y == -1 &&
-            voxel_position.z == -1 && voxel_position.w == -1)
-        {
-            z_buffer[z_buffer_offset] = -1;
+        uchar4 voxel_info = vload4(hypotheses_offset, hypotheses);
+        if (voxel_info.z == 0 && voxel_info.w == 0)
             return;
-        }
-
-        // calculate offset to voxel in hypothesis buffer
-       hypotheses_offset = voxel_position.x*(1 + number_of_images) +
-                           voxel_position.y*dimensions[0]*(1 + number_of_images) +
-                           voxel_position.z*dimensions[0]*dimensions[1]*(1 + number_of_images);
-
-        // check is voxel visible
-        if (vload4(hypotheses_offset, hypotheses).x == 1)
-            find_voxel = 1;                                 // if voxel is visible
-        else
-        {
-            step += step_size;
-        }
     }
 
-    //save voxel index
-    __const int voxel_index = voxel_position.x + voxel_position.y*dimensions[0] + voxel_position.z*dimensions[0]*dimensions[1];
-    z_buffer[z_buffer_offset] = voxel_index;
-
     uchar4 hypothesis_color = vload4(hypotheses_offset + 1 + current_image_number, hypotheses);
 
     // if hypothesis is not consist
     if ((hypothesis_color.x + hypothesis_color.y + hypothesis_color.z + hypothesis_color.w) == 0)
         return;
 
+    float4 hypothesis_coordinates = hypothesis_color_coordinates(voxel_index, current_image_number, number_of_images, hypotheses, chromaticities);
+    __const float color_threshold_of_metric = color_threshold(threshold);
+
     uint consistent = 0;
     float4 pos_at_second_image;
     uint z_buffer_offset_second;
 
-    float4 voxel_position_3d = (float4)(bounding_box[0] + ((float)voxel_position.x + 0.5f)*bounding_box[3]/(float)dimensions[0],
-                                        bounding_box[1] + ((float)voxel_position.y + 0.5f)*bounding_box[4]/(float)dimensions[1],
-                                        bounding_box[2] + ((float)voxel_position.z + 0.5f)*bounding_box[5]/(float)dimensions[2],
+    __global __const float * scene_bounding_box = bounding_box + scene*6;
+    __const uint scene_z = voxel_position.z - scene*dimensions[2];
+
+    float4 voxel_position_3d = (float4)(scene_bounding_box[0] + ((float)voxel_position.x + 0.5f)*scene_bounding_box[3]/(float)dimensions[0],
+                                        scene_bounding_box[1] + ((float)voxel_position.y + 0.5f)*scene_bounding_box[4]/(float)dimensions[1],
+                                        scene_bounding_box[2] + ((float)scene_z + 0.5f)*scene_bounding_box[5]/(float)dimensions[2],
                                         1.0f);
 
+#ifdef COVC_METRIC_VARIANCE
+    // mean color of the views which see the voxel
+    float4 mean = hypothesis_coordinates;
+    uint number_of_colors = 1;
+#endif
+
+    __const uint number_of_traced_images = first_image + images_per_launch;
 
-    for (uint i = 0; i < number_of_images && consistent == 0; ++i)
+    for (uint i = 0; i < number_of_traced_images && consistent == 0; ++i)
     {
-        pos_at_second_image = position_at_image(projection_matrices[i], voxel_position_3d);
+        if (i == current_image_number)
+            continue;
+
+        pos_at_second_image = position_at_image(projection_matrices[first_view_of_scene + i], voxel_position_3d);
         pos_at_second_image.z = i;
 
-        if (is_in_image(pos_at_second_image, (float4)(0.0f, 0.0f, convert_float(width), convert_float(height))))
+        if (!is_in_image(pos_at_second_image, (float4)(0.0f, 0.0f, convert_float(width), convert_float(height))))
             continue;
 
         z_buffer_offset_second = (uint)floor(pos_at_second_image.x) +
                                  (uint)floor(pos_at_second_image.y)*width +
-                                 i*width*height;
+                                 (first_view_of_scene + i)*width*height;
 
-        // if hypothesis not occupied and
-        // in z buffer we have the same voxel as current and
-        // if it is not the same hypothesis
-        if (z_buffer[z_buffer_offset_second] == voxel_index &&  i != current_image_number)
+        // if in z buffer we have the same voxel as current
+        if (z_buffer[z_buffer_offset_second] == voxel_index)
         {
-            uint current_offset = hypotheses_offset + 1 + i;
-            uchar4 color = vload4 (current_offset, hypotheses);
-
-            if (isless(distance(normalize(convert_float4(color)), normalize(convert_float4(hypothesis_color))), threshold))
+            float4 coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+
+#ifdef COVC_METRIC_VARIANCE
+            if (!is_empty_color(coordinates))
+            {
+                mean += coordinates;
+                number_of_colors++;
+            }
+#else
+            if (isless(color_difference(coordinates, hypothesis_coordinates), color_threshold_of_metric))
                 consistent = 1;
+#endif
         }
     }
 
+#ifdef COVC_METRIC_VARIANCE
+    consistent = number_of_colors > 1 &&
+                 isless(color_difference(hypothesis_coordinates, mean/(float)number_of_colors), color_threshold_of_metric);
+#endif
+
     // hypothesis is not consistent
     if (!consistent)
-        vstore4((uchar4)(0), hypotheses_offset + 1 + current_image_number, hypotheses);
-    else
-        vstore4(hypothesis_color, hypotheses_offset + 1 + current_image_number, hypotheses);
+    {
+        if (deferred)
+            rejections[z_buffer_offset] = 1;
+        else
+            reject_hypothesis(voxel_index, current_image_number, number_of_images, hypotheses, chromaticities);
+    }
+}
+
+// reject hypotheses of pixels marked by deferred inconsistent_voxel_rejection.
+// run with the same sizes
+__kernel void
+apply_rejections (__global uchar * hypotheses,
+                  __global __const int * z_buffer,
+                  __global __const uchar * rejections,
+                  uint first_image,
+                  uint images_per_launch,
+                  uint number_of_images,
+                  __global ushort2 * chromaticities,
+                  __global __const uint * iteration_info,
+                  uint previous_iteration)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
+    uint scene = get_global_id(2)/images_per_launch;
+    uint current_image_number = first_image + get_global_id(2)%images_per_launch;
+    uint width = get_global_size(0);
+    uint height = get_global_size(1);
+
+    __const uint z_buffer_offset = x + y*width + (scene*number_of_images + current_image_number)*width*height;
+
+    if (rejections[z_buffer_offset] == 0)
+        return;
+
+    reject_hypothesis(z_buffer[z_buffer_offset], current_image_number, number_of_images, hypotheses, chromaticities);
+}
+
+// views which see a voxel are kept as bits of two uints per voxel of the
+// stacked grid, views_of_voxels. MAX_VIEWS_OF_VOXEL is defined by build
+// options, see VoxelColorer::get_program_build_options
+#if MAX_VIEWS_OF_VOXEL > 64
+#error views of a voxel do not fit two uints
+#endif
+
+// clear views of voxels of slices [first_slice, last_slice) of the stacked
+// grid, one work item per voxel. check_voxel_consistency clears the voxels it
+// checks, so this is run once before the first iteration
+__kernel void
+clear_views_of_voxels (__global uint * views_of_voxels)
+{
+    uint voxel_index = get_global_id(0) +
+                       get_global_id(1)*get_global_size(0) +
+                       get_global_id(2)*get_global_size(0)*get_global_size(1);
+
+    vstore2((uint2)(0), voxel_index, views_of_voxels);
+}
+
+// set the bit of view in views of the voxel seen by every pixel of z buffers,
+// so a view sees the voxel if any of its pixels does. only voxels of slices
+// [first_slice, last_slice) of the stacked grid are marked, the rest belong
+// to other devices. run with the sizes of trace_z_buffer for all views
+__kernel void
+mark_views_of_voxels (__global __const int * z_buffer,
+                      __global __const uint * dimensions,
+                      uint number_of_images,
+                      uint first_slice,
+                      uint last_slice,
+                      __global uint * views_of_voxels,
+                      __global __const uint * iteration_info,
+                      uint previous_iteration)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    uint x = get_global_id(0);
+    uint y = get_global_id(1);
+    uint view = get_global_id(2);
+    uint width = get_global_size(0);
+    uint height = get_global_size(1);
+
+    __const int voxel_index = z_buffer[x + y*width + view*width*height];
+    if (voxel_index == -1)
+        return;
+
+    __const uint slice = voxel_index / (dimensions[0]*dimensions[1]);
+    if (slice < first_slice || slice >= last_slice)
+        return;
+
+    __const uint image_number = view % number_of_images;
+
+    atomic_or(views_of_voxels + voxel_index*2 + image_number/32, 1u << (image_number % 32));
+}
+
+// the same check as inconsistent_voxel_rejection, but once for every voxel of
+// list of visible voxels (see step_2_3_compact_visible_voxels.cl) after z
+// buffers of all views are traced and marked by mark_views_of_voxels.
+// hypotheses of the views which see the voxel are checked against each other
+// and all of them are decided before any is rejected. views of the voxel are
+// cleared for the next iteration. number_of_images is at most
+// MAX_VIEWS_OF_VOXEL
+__kernel void
+check_voxel_consistency (__global uchar * hypotheses,
+                         uint number_of_images,
+                         float threshold,
+                         uint number_of_voxels,
+                         __global __const uint * voxels,
+                         __global __const uint * list_sizes,
+                         uint list,
+                         __global ushort2 * chromaticities,
+                         __global uint * views_of_voxels,
+                         __global __const uint * iteration_info,
+                         uint previous_iteration,
+                         uint incremental)
+{
+    if (is_converged(iteration_info, previous_iteration))
+        return;
+
+    uint candidate = get_global_id(0);
+    if (candidate >= list_sizes[list])
+        return;
+
+    __const int voxel_index = voxels[list*number_of_voxels + candidate];
+    __const uint hypotheses_offset = voxel_index*(1 + number_of_images);
+
+    uint2 views = vload2(voxel_index, views_of_voxels);
+    vstore2((uint2)(0), voxel_index, views_of_voxels);
+
+    __const ulong views_of_voxel = upsample(views.y, views.x);
+
+    if (incremental)
+    {
+        uchar4 voxel_info = vload4(hypotheses_offset, hypotheses);
+        if (voxel_info.z == 0 && voxel_info.w == 0)
+            return;
+    }
+
+    // views which see the voxel and have consistent hypothesis
+    ulong seen = 0;
+
+#ifdef COVC_METRIC_VARIANCE
+    // mean color of the views which see the voxel
+    float4 mean = (float4)(0.0f);
+    uint number_of_colors = 0;
+#endif
+
+    for (uint i = 0; i < number_of_images; ++i)
+    {
+        if ((views_of_voxel & (1UL << i)) == 0)
+            continue;
+
+        uchar4 color = vload4(hypotheses_offset + 1 + i, hypotheses);
+
+        // if hypothesis is consistent
+        if ((color.x + color.y + color.z + color.w) != 0)
+        {
+            seen |= 1UL << i;
+
+#ifdef COVC_METRIC_VARIANCE
+            float4 coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+            if (!is_empty_color(coordinates))
+            {
+                mean += coordinates;
+                number_of_colors++;
+            }
+#endif
+        }
+    }
+
+    __const float color_threshold_of_metric = color_threshold(threshold);
+
+#ifdef COVC_METRIC_VARIANCE
+    mean /= (float)max(number_of_colors, 1u);
+#endif
+
+    // hypotheses which are not consistent
+    ulong rejected = 0;
+
+    for (uint i = 0; i < number_of_images; ++i)
+    {
+        if ((seen & (1UL << i)) == 0)
+            continue;
+
+        float4 hypothesis_coordinates = hypothesis_color_coordinates(voxel_index, i, number_of_images, hypotheses, chromaticities);
+
+#ifdef COVC_METRIC_VARIANCE
+        uint consistent = number_of_colors > 1 &&
+                          isless(color_difference(hypothesis_coordinates, mean), color_threshold_of_metric);
+#else
+        uint consistent = 0;
+
+        for (uint j = 0; j < number_of_images && consistent == 0; ++j)
+        {
+            if (j == i || (seen & (1UL << j)) == 0)
+                continue;
+
+            float4 coordinates = hypothesis_color_coordinates(voxel_index, j, number_of_images, hypotheses, chromaticities);
+
+            if (isless(color_difference(coordinates, hypothesis_coordinates), color_threshold_of_metric))
+                consistent = 1;
+        }
+#endif
+
+        if (!consistent)
+            rejected |= 1UL << i;
+    }
+
+    for (uint i = 0; i < number_of_images; ++i)
+        if (rejected & (1UL << i))
+            reject_hypothesis(voxel_index, i, number_of_images, hypotheses, chromaticities);
 }
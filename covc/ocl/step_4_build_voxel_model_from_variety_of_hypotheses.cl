@@ -20,48 +20,52 @@
  * THE SOFTWARE.
  */
 
+// voxels which are not in the list are invisible, so the model of the slab
+// is cleared before visible voxels are written
+__kernel void
+clear_voxel_model (__global uint * voxel_model,
+                   uint first_voxel)
+{
+    voxel_model[first_voxel + get_global_id(0)] = 0;
+}
+
+// color of every voxel of list of visible voxels, see
+// step_2_3_compact_visible_voxels.cl. global size is a bound of list size
 __kernel void
 build_voxel_model ( __global uchar * hypotheses,
                     __global uchar * voxel_model,
-                    __global __const uint * dimensions,
-                    uint number_of_images)
+                    uint number_of_images,
+                    uint number_of_voxels,
+                    __global __const uint * voxels,
+                    __global __const uint * list_sizes,
+                    uint list)
 {
-    uint4 pos = (uint4) (get_global_id(0), get_global_id(1), get_global_id(2), 0);
+    uint candidate = get_global_id(0);
+    if (candidate >= list_sizes[list])
+        return;
 
-    __const uint hypothesis_offset = pos.x*(1 + number_of_images) +
-                                     pos.y*dimensions[0]*(1 + number_of_images) +
-                                     pos.z*dimensions[0]*dimensions[1]*(1 + number_of_images);
+    __const uint voxel = voxels[list*number_of_voxels + candidate];
+    __const uint hypothesis_offset = voxel*(1 + number_of_images);
 
     uint4 result_color = (uint4)(0);
     uint  result_number_of_hypotheses = 0;
 
-    uchar4 voxel_info = vload4(hypothesis_offset, hypotheses);
-
-    // if voxel is visible
-    if (voxel_info.x != 0)
+    for (uint i = 0; i < number_of_images; ++i)
     {
-        for (uint i = 0; i < number_of_images; ++i)
-        {
-            uchar4 color = vload4(hypothesis_offset + 1 + i, hypotheses);
+        uchar4 color = vload4(hypothesis_offset + 1 + i, hypotheses);
 
-            // if hypothesis is consistent
-            if ((color.x + color.y + color.z + color.w) != 0)
-            {
-                result_color.x += color.x;
-                result_color.y += color.y;
-                result_color.z += color.z;
-                result_color.w += color.w;
-                result_number_of_hypotheses++;
-            }
+        // if hypothesis is consistent
+        if ((color.x + color.y + color.z + color.w) != 0)
+        {
+            result_color.x += color.x;
+            result_color.y += color.y;
+            result_color.z += color.z;
+            result_color.w += color.w;
+            result_number_of_hypotheses++;
         }
-
-        result_color /= result_number_of_hypotheses;
-
-        vstore4((uchar4)(0, result_color.x, result_color.y, result_color.z),
-                pos.x + pos.y*dimensions[0] + pos.z*dimensions[0]*dimensions[1],
-                voxel_model);
     }
-    else
-        vstore4((uchar4)(0, 0, 0, 0), pos.x + pos.y*dimensions[0] + pos.z*dimensions[0]*dimensions[1], voxel_model);
 
- }
+    result_color /= result_number_of_hypotheses;
+
+    vstore4((uchar4)(0, result_color.x, result_color.y, result_color.z), voxel, voxel_model);
+}
@@ -0,0 +1,813 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "nativebackend.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+namespace
+{
+
+///////////////////////////////////////////////////////////////////////////////
+//! Helpers. Each one repeats the OpenCL function with the same name, the
+//! order of floating point operations is kept as is.
+///////////////////////////////////////////////////////////////////////////////
+inline void mul_mat_vec(const float * mat, const float * vec, float * res)
+{
+    res[0] = mat[ 0]*vec[0] + mat[ 1]*vec[1] + mat[ 2]*vec[2] + mat[ 3]*vec[3];
+    res[1] = mat[ 4]*vec[0] + mat[ 5]*vec[1] + mat[ 6]*vec[2] + mat[ 7]*vec[3];
+    res[2] = mat[ 8]*vec[0] + mat[ 9]*vec[1] + mat[10]*vec[2] + mat[11]*vec[3];
+    res[3] = mat[12]*vec[0] + mat[13]*vec[1] + mat[14]*vec[2] + mat[15]*vec[3];
+}
+
+inline bool is_in_image(float x, float y, size_t width, size_t height)
+{
+    return x >= 0.0f && x < (float)width &&
+           y >= 0.0f && y < (float)height;
+}
+
+inline bool is_consistent(const unsigned char * color)
+{
+    return (color[0] + color[1] + color[2] + color[3]) != 0;
+}
+
+inline void normalize(const unsigned char * color, float * result)
+{
+    float length = sqrtf((float)color[0]*(float)color[0] +
+                         (float)color[1]*(float)color[1] +
+                         (float)color[2]*(float)color[2] +
+                         (float)color[3]*(float)color[3]);
+
+    for (size_t i = 0; i < 4; ++i)
+        result[i] = length != 0.0f ? (float)color[i]/length : 0.0f;
+}
+
+// color metric helpers of ocl/common/color_metric.cl. empty hypothesis has
+// infinite coordinates, so it is close to nothing
+void color_coordinates(const unsigned char * color, NativeColorMetric metric, float * result)
+{
+    if (!is_consistent(color))
+    {
+        for (size_t i = 0; i < 4; ++i)
+            result[i] = INFINITY;
+        return;
+    }
+
+    if (metric == NATIVE_COLOR_METRIC_CHROMATICITY)
+    {
+        float sum = (float)color[0] + (float)color[1] + (float)color[2];
+
+        for (size_t i = 0; i < 4; ++i)
+            result[i] = (float)color[i]/sum;
+    }
+    else if (metric == NATIVE_COLOR_METRIC_CIELAB)
+    {
+        float rgb[3];
+        for (size_t i = 0; i < 3; ++i)
+        {
+            rgb[i] = (float)color[i]*(1.0f/255.0f);
+            rgb[i] *= rgb[i];
+        }
+
+        // D65 white point
+        float xyz[3] = {(rgb[0]*0.4124f + rgb[1]*0.3576f + rgb[2]*0.1805f)/0.9505f,
+                        rgb[0]*0.2126f + rgb[1]*0.7152f + rgb[2]*0.0722f,
+                        (rgb[0]*0.0193f + rgb[1]*0.1192f + rgb[2]*0.9505f)/1.0890f};
+        float f[3];
+        for (size_t i = 0; i < 3; ++i)
+            f[i] = xyz[i] < 0.008856f ? 7.787f*xyz[i] + 16.0f/116.0f : cbrtf(xyz[i]);
+
+        result[0] = 116.0f*f[1] - 16.0f;
+        result[1] = 500.0f*(f[0] - f[1]);
+        result[2] = 200.0f*(f[1] - f[2]);
+        result[3] = 0.0f;
+    }
+    else
+        normalize(color, result);
+}
+
+inline bool is_squared_color_difference(NativeColorMetric metric)
+{
+    return metric != NATIVE_COLOR_METRIC_NORMALIZED_RGB;
+}
+
+inline float color_difference(const float * a, const float * b, NativeColorMetric metric)
+{
+    float squared_distance = (a[0] - b[0])*(a[0] - b[0]) +
+                             (a[1] - b[1])*(a[1] - b[1]) +
+                             (a[2] - b[2])*(a[2] - b[2]) +
+                             (a[3] - b[3])*(a[3] - b[3]);
+
+    return is_squared_color_difference(metric) ? squared_distance : sqrtf(squared_distance);
+}
+
+inline float color_threshold(float threshold, NativeColorMetric metric)
+{
+    return is_squared_color_difference(metric) ? threshold*threshold : threshold;
+}
+
+inline bool is_empty_color(const float * coordinates)
+{
+    return isinf(coordinates[3]);
+}
+
+// mean coordinates of the hypotheses which are not empty
+size_t mean_color_coordinates(const float * coordinates, size_t number_of_hypotheses, float * mean)
+{
+    size_t number_of_colors = 0;
+
+    for (size_t c = 0; c < 4; ++c)
+        mean[c] = 0.0f;
+
+    for (size_t i = 0; i < number_of_hypotheses; ++i)
+    {
+        if (is_empty_color(&coordinates[i*4]))
+            continue;
+
+        for (size_t c = 0; c < 4; ++c)
+            mean[c] += coordinates[i*4 + c];
+        number_of_colors++;
+    }
+
+    if (number_of_colors != 0)
+        for (size_t c = 0; c < 4; ++c)
+            mean[c] /= (float)number_of_colors;
+
+    return number_of_colors;
+}
+
+// min(max((int)pos, 0), dimension-1) without undefined float to int conversion
+inline int voxel_coordinate(float pos, size_t dimension)
+{
+    if (!(pos >= 1.0f))
+        return 0;
+    if (pos >= (float)dimension)
+        return (int)dimension - 1;
+    return std::min((int)pos, (int)dimension - 1);
+}
+
+// intersect ray with a box
+// http://www.siggraph.org/education/materials/HyperGraph/raytrace/rtinter3.htm
+bool intersect_box(const float * r_o, const float * r_d,
+                   const float * boxmin, const float * boxmax,
+                   float * tnear, float * tfar)
+{
+    float tmin[3], tmax[3];
+    for (size_t i = 0; i < 3; ++i)
+    {
+        float invR = 1.0f / r_d[i];
+        float tbot = invR * (boxmin[i] - r_o[i]);
+        float ttop = invR * (boxmax[i] - r_o[i]);
+
+        tmin[i] = fminf(ttop, tbot);
+        tmax[i] = fmaxf(ttop, tbot);
+    }
+
+    float largest_tmin = fmaxf(fmaxf(tmin[0], tmin[1]), fmaxf(tmin[0], tmin[2]));
+    float smallest_tmax = fminf(fminf(tmax[0], tmax[1]), fminf(tmax[0], tmax[2]));
+
+    *tnear = largest_tmin;
+    *tfar = smallest_tmax;
+
+    return smallest_tmax > largest_tmin;
+}
+
+// voxel walk from the box entry point, see trace_ray kernel helper
+int trace_ray(const float * ray_origin, const float * ray_direction,
+              const float * bounding_box, const size_t * dimensions,
+              const unsigned char * hypotheses, size_t hypotheses_size)
+{
+    float box_min[3] = {bounding_box[0], bounding_box[1], bounding_box[2]};
+    float box_max[3] = {bounding_box[0] + bounding_box[3],
+                        bounding_box[1] + bounding_box[4],
+                        bounding_box[2] + bounding_box[5]};
+
+    float tnear, tfar;
+    if (!intersect_box(ray_origin, ray_direction, box_min, box_max, &tnear, &tfar) || tfar < 0.0f)
+        return -1;
+
+    // the camera may be inside the box
+    const float t = fmaxf(tnear, 0.0f);
+
+    int voxel[3];
+    int step[3];
+    float t_max[3];
+    float t_delta[3];
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        float voxel_size = bounding_box[3 + i]/(float)dimensions[i];
+        float entry_position = ray_origin[i] + ray_direction[i]*t;
+
+        voxel[i] = voxel_coordinate((entry_position - bounding_box[i])/voxel_size, dimensions[i]);
+        step[i] = ray_direction[i] < 0.0f ? -1 : 1;
+
+        float boundary = bounding_box[i] + (float)(voxel[i] + (step[i] > 0))*voxel_size;
+        t_max[i] = ray_direction[i] != 0.0f ? (boundary - ray_origin[i])/ray_direction[i] : INFINITY;
+        t_delta[i] = ray_direction[i] != 0.0f ? fabsf(voxel_size/ray_direction[i]) : INFINITY;
+    }
+
+    for (;;)
+    {
+        int index = voxel[0] + voxel[1]*(int)dimensions[0] + voxel[2]*(int)dimensions[0]*(int)dimensions[1];
+
+        // check is voxel visible
+        if (hypotheses[index*hypotheses_size*4] == 1)
+            return index;
+
+        size_t axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) :
+                                            (t_max[1] < t_max[2] ? 1 : 2);
+
+        if (t_max[axis] > tfar)
+            return -1;
+
+        voxel[axis] += step[axis];
+        if (voxel[axis] < 0 || voxel[axis] >= (int)dimensions[axis])
+            return -1;
+
+        t_max[axis] += t_delta[axis];
+    }
+}
+
+} // namespace
+
+NativeBackend::NativeBackend()
+{
+    memset(&scene, 0, sizeof(scene));
+}
+
+NativeBackend::~NativeBackend()
+{
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Build voxel model from seqence of images and matrices
+//!
+//! @param scene Images, matrices and parameters of the algorithm
+//! @param voxel_model Result. size = dimension[0]*dimension[1]*dimension[2]*4
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::build_voxel_model(const NativeScene & _scene, unsigned char * voxel_model)
+{
+    if (!thread_pool.get())
+        prepare();
+
+    scene = _scene;
+
+    unsigned int iteration_info[2];
+    iteration_info[0] = 0;
+    iteration_info[1] = 0;
+
+    hypotheses.resize(number_of_voxels()*(1 + scene.number_of_images)*4);
+
+    run_step_1();
+    run_step_2();
+    run_step_2_3(iteration_info);
+
+    std::cout << "Number of consistent hypotheses = " << iteration_info[0] << std::endl;
+    std::cout << "Number of visible voxels = " << iteration_info[1] << std::endl;
+
+    run_step_3(iteration_info);
+    run_step_4(voxel_model);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Port of threshold sweep: step 1 and calculate_threshold_histogram kernel
+//!
+//! @param scene Images, matrices and parameters of the algorithm
+//! @param thresholds Ascending thresholds
+//! @param histogram Receives thresholds.size() + 1 bins of hypotheses, then
+//! the same of voxels
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::calculate_threshold_histogram(const NativeScene & _scene, const std::vector<float> & thresholds, unsigned int * histogram)
+{
+    if (!thread_pool.get())
+        prepare();
+
+    scene = _scene;
+
+    hypotheses.resize(number_of_voxels()*(1 + scene.number_of_images)*4);
+
+    run_step_1();
+
+    std::cout << "Run threshold sweep..." << std::endl;
+
+    const size_t number_of_images = scene.number_of_images;
+    const size_t hypotheses_size = 1 + number_of_images;
+    const size_t number_of_rows = scene.dimensions[1]*scene.dimensions[2];
+    const size_t number_of_bins = 2*(thresholds.size() + 1);
+    const NativeColorMetric metric = scene.color_metric;
+
+    std::vector<float> thresholds_of_metric(thresholds.size());
+    for (size_t i = 0; i < thresholds.size(); ++i)
+        thresholds_of_metric[i] = color_threshold(thresholds[i], metric);
+
+    std::vector<unsigned int> histograms_by_rows(number_of_rows*number_of_bins, 0);
+
+    thread_pool->run(number_of_rows, [&](size_t row)
+    {
+        std::vector<float> coordinates(number_of_images*4);
+        unsigned int * row_histogram = &histograms_by_rows[row*number_of_bins];
+
+        for (size_t x = 0; x < scene.dimensions[0]; ++x)
+        {
+            const unsigned char * voxel = &hypotheses[(x + row*scene.dimensions[0])*hypotheses_size*4];
+
+            // if voxel not visible
+            if (voxel[0] == 0)
+                continue;
+
+            for (size_t i = 0; i < number_of_images; ++i)
+                color_coordinates(voxel + (1 + i)*4, metric, &coordinates[i*4]);
+
+            float mean[4];
+            size_t number_of_colors = 0;
+            if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+                number_of_colors = mean_color_coordinates(coordinates.data(), number_of_images, mean);
+
+            size_t voxel_bin = thresholds.size();
+
+            for (size_t pos = 0; pos < number_of_images; ++pos)
+            {
+                // if hypothesis is not consist
+                if (is_empty_color(&coordinates[pos*4]))
+                    continue;
+
+                // empty hypotheses are infinitely far and make nothing
+                // consistent, fminf skips NaN of two of them
+                float smallest_difference = INFINITY;
+                if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+                {
+                    if (number_of_colors > 1)
+                        smallest_difference = color_difference(&coordinates[pos*4], mean, metric);
+                }
+                else
+                {
+                    for (size_t i = 0; i < number_of_images; ++i)
+                        if (i != pos)
+                            smallest_difference = fminf(smallest_difference,
+                                                        color_difference(&coordinates[i*4], &coordinates[pos*4], metric));
+                }
+
+                // the first threshold which keeps the hypothesis
+                size_t bin = 0;
+                while (bin < thresholds.size() && !(smallest_difference < thresholds_of_metric[bin]))
+                    bin++;
+
+                row_histogram[bin]++;
+                voxel_bin = std::min(voxel_bin, bin);
+            }
+
+            row_histogram[thresholds.size() + 1 + voxel_bin]++;
+        }
+    });
+
+    for (size_t bin = 0; bin < number_of_bins; ++bin)
+        histogram[bin] = 0;
+
+    for (size_t row = 0; row < number_of_rows; ++row)
+        for (size_t bin = 0; bin < number_of_bins; ++bin)
+            histogram[bin] += histograms_by_rows[row*number_of_bins + bin];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Start worker threads
+//!
+//! @param number_of_threads Number of threads, 0 - one per hardware thread
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::prepare(size_t number_of_threads)
+{
+    thread_pool.reset(new ThreadPool(number_of_threads));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! step 1: for each voxel build variety of hypotheses
+//! HYPOTHESIS EXTRACTION
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_1()
+{
+    std::cout << "Run step 1..." << std::endl;
+
+    const size_t * dimensions = scene.dimensions;
+    const float * bounding_box = scene.bounding_box;
+    const size_t hypotheses_size = 1 + scene.number_of_images;
+
+    thread_pool->run(dimensions[1]*dimensions[2], [&](size_t row)
+    {
+        size_t y = row % dimensions[1];
+        size_t z = row / dimensions[1];
+
+        for (size_t x = 0; x < dimensions[0]; ++x)
+        {
+            float voxel_pos_3d[4] = {bounding_box[0] + ((float)x + 0.5f)*(bounding_box[3]/(float)dimensions[0]),
+                                     bounding_box[1] + ((float)y + 0.5f)*(bounding_box[4]/(float)dimensions[1]),
+                                     bounding_box[2] + ((float)z + 0.5f)*(bounding_box[5]/(float)dimensions[2]),
+                                     1.0f};
+
+            unsigned char * voxel = &hypotheses[(x + y*dimensions[0] + z*dimensions[0]*dimensions[1])*hypotheses_size*4];
+
+            // set voxel visible and non zero number of consists hypotheses
+            voxel[0] = 1;
+            voxel[1] = UCHAR_MAX;
+            voxel[2] = 0;
+            voxel[3] = 0;
+
+            for (size_t i = 0; i < scene.number_of_images; ++i)
+            {
+                float pos_at_image_3d[4];
+                mul_mat_vec(&scene.projection_matrices[i*16], voxel_pos_3d, pos_at_image_3d);
+
+                float pos_x = pos_at_image_3d[0]/pos_at_image_3d[2];
+                float pos_y = pos_at_image_3d[1]/pos_at_image_3d[2];
+
+                unsigned char * hypothesis = voxel + (1 + i)*4;
+                memset(hypothesis, 0, 4);
+
+                if (!is_in_image(pos_x, pos_y, scene.width, scene.height))
+                    continue;
+
+                // we have ARGB format
+                const unsigned char * pixel = &scene.pixels[((size_t)floorf(pos_x) +
+                                                             (size_t)floorf(pos_y)*scene.width +
+                                                             i*scene.width*scene.height)*4];
+
+                if (pixel[1] < 10 && pixel[2] < 10 && pixel[3] < 10)
+                    continue;
+
+                hypothesis[0] = pixel[1];
+                hypothesis[1] = pixel[2];
+                hypothesis[2] = pixel[3];
+            }
+        }
+    });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! step 2: initial inconsistent voxels rejection
+//! CONSISTENCY CHECK AND HYPOTHESIS REMOVAL
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_2()
+{
+    std::cout << "Run step 2..." << std::endl;
+
+    const size_t number_of_images = scene.number_of_images;
+    const size_t hypotheses_size = 1 + number_of_images;
+
+    const NativeColorMetric metric = scene.color_metric;
+    const float threshold = color_threshold(scene.threshold, metric);
+
+    thread_pool->run(scene.dimensions[1]*scene.dimensions[2], [&](size_t row)
+    {
+        // color coordinates of all hypotheses of voxel
+        std::vector<float> coordinates(number_of_images*4);
+        std::vector<unsigned char> rejected(number_of_images);
+
+        for (size_t x = 0; x < scene.dimensions[0]; ++x)
+        {
+            unsigned char * voxel = &hypotheses[(x + row*scene.dimensions[0])*hypotheses_size*4];
+
+            // if voxel not visible
+            if (voxel[0] == 0)
+                continue;
+
+            for (size_t i = 0; i < number_of_images; ++i)
+                color_coordinates(voxel + (1 + i)*4, metric, &coordinates[i*4]);
+
+            float mean[4];
+            size_t number_of_colors = 0;
+            if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+                number_of_colors = mean_color_coordinates(coordinates.data(), number_of_images, mean);
+
+            for (size_t pos = 0; pos < number_of_images; ++pos)
+            {
+                rejected[pos] = 0;
+
+                // if hypothesis is not consist
+                if (is_empty_color(&coordinates[pos*4]))
+                    continue;
+
+                unsigned int consistent = 0;
+                if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+                {
+                    // the only hypothesis of voxel is not consistent with anything
+                    consistent = number_of_colors > 1 &&
+                                 color_difference(&coordinates[pos*4], mean, metric) < threshold;
+                }
+                else
+                {
+                    for (size_t i = 0; i < number_of_images; ++i)
+                        consistent |= (i != pos) & (color_difference(&coordinates[i*4], &coordinates[pos*4], metric) < threshold);
+                }
+
+                rejected[pos] = !consistent;
+            }
+
+            // hypothesis is not consistent
+            for (size_t pos = 0; pos < number_of_images; ++pos)
+                if (rejected[pos])
+                    memset(voxel + (1 + pos)*4, 0, 4);
+        }
+    });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Recount consistent hypotheses of each voxel and calculate iteration info.
+//! Port of calculate_iteration_info kernel.
+//!
+//! @param iteration_info number of consistent hypotheses and visible voxels
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_2_3(unsigned int * iteration_info)
+{
+    const size_t number_of_rows = scene.dimensions[1]*scene.dimensions[2];
+    const size_t hypotheses_size = 1 + scene.number_of_images;
+
+    std::vector<unsigned int> hypotheses_by_rows(number_of_rows);
+    std::vector<unsigned int> voxels_by_rows(number_of_rows);
+
+    thread_pool->run(number_of_rows, [&](size_t row)
+    {
+        unsigned int hypotheses_result = 0;
+        unsigned int voxels_result = 0;
+
+        for (size_t x = 0; x < scene.dimensions[0]; ++x)
+        {
+            unsigned char * voxel = &hypotheses[(x + row*scene.dimensions[0])*hypotheses_size*4];
+
+            // if voxel is not visible
+            if (voxel[0] == 0)
+                continue;
+
+            unsigned char consistent_hypotheses = 0;
+            for (size_t i = 0; i < scene.number_of_images; ++i)
+                if (is_consistent(voxel + (1 + i)*4))
+                    consistent_hypotheses++;
+
+            if (consistent_hypotheses == 0)
+            {
+                // make voxel invisible
+                memset(voxel, 0, 4);
+                continue;
+            }
+
+            voxel[1] = consistent_hypotheses;
+
+            hypotheses_result += voxel[1];
+            voxels_result++;
+        }
+
+        hypotheses_by_rows[row] = hypotheses_result;
+        voxels_by_rows[row] = voxels_result;
+    });
+
+    iteration_info[0] = 0;
+    iteration_info[1] = 0;
+    for (size_t row = 0; row < number_of_rows; ++row)
+    {
+        iteration_info[0] += hypotheses_by_rows[row];
+        iteration_info[1] += voxels_by_rows[row];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! step 3: inconsistent hypotheses rejection. visibility buffer in use
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_3(unsigned int * iteration_info)
+{
+    unsigned int old_number_of_consistent_hypotheses = UINT_MAX;
+
+    z_buffer.resize(scene.width*scene.height*scene.number_of_images);
+    consistency.resize(scene.width*scene.height);
+
+    std::cout << "Run step 3..." << std::endl;
+
+    while (iteration_info[0] != old_number_of_consistent_hypotheses)
+    {
+        old_number_of_consistent_hypotheses = iteration_info[0];
+
+        // fill z buffer with non occupied values
+        std::fill(z_buffer.begin(), z_buffer.end(), -1);
+
+        std::cout << "Run step 3 next iteration..." << std::endl;
+
+        for (size_t i = 0; i < scene.number_of_images; ++i)
+            run_step_3_for_image(i);
+
+        std::cout << "Remove hypotheses and compute iteration info" << std::endl;
+
+        run_step_2_3(iteration_info);
+
+        std::cout << "Number of consistent hypotheses = " << iteration_info[0] << std::endl;
+        std::cout << "Number of visible voxels = " << iteration_info[1] << std::endl;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Port of trace_z_buffer and inconsistent_voxel_rejection kernel launches
+//! for one image.
+//!
+//! Consistency of all pixels is checked before any hypothesis is rejected.
+//! The kernel never writes consistent hypotheses, so the result is the same.
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_3_for_image(size_t current_image_number)
+{
+    const size_t * dimensions = scene.dimensions;
+    const float * bounding_box = scene.bounding_box;
+    const size_t width = scene.width;
+    const size_t height = scene.height;
+    const size_t hypotheses_size = 1 + scene.number_of_images;
+    const NativeColorMetric metric = scene.color_metric;
+    const float threshold = color_threshold(scene.threshold, metric);
+
+    int * current_z_buffer = &z_buffer[current_image_number*width*height];
+
+    // trace rays
+    thread_pool->run(height, [&](size_t y)
+    {
+        const float * image_calibration_matrix = &scene.image_calibration_matrices[current_image_number*16];
+        const float * unprojection_matrix = &scene.unprojection_matrices[current_image_number*16];
+
+        float eye_ray_o[4] = {image_calibration_matrix[3],
+                              image_calibration_matrix[7],
+                              image_calibration_matrix[11],
+                              0.0f};
+
+        for (size_t x = 0; x < width; ++x)
+        {
+            // map to [-1, 1] coordinates
+            float u = (x / (float) width)*2.0f-1.0f;
+            float v = (y / (float) height)*2.0f-1.0f;
+
+            float temp[4] = {u, v, 1.0f, 1.0f};
+            float eye_ray_d[4];
+            mul_mat_vec(unprojection_matrix, temp, eye_ray_d);
+
+            current_z_buffer[x + y*width] = trace_ray(eye_ray_o, eye_ray_d, bounding_box, dimensions,
+                                                      hypotheses.data(), hypotheses_size);
+        }
+    });
+
+    // check consistency
+    thread_pool->run(height, [&](size_t y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            consistency[x + y*width] = 1;
+
+            const int voxel_index = current_z_buffer[x + y*width];
+            if (voxel_index == -1)
+                continue;
+
+            const unsigned char * voxel = &hypotheses[voxel_index*hypotheses_size*4];
+            const unsigned char * hypothesis_color = voxel + (1 + current_image_number)*4;
+
+            // if hypothesis is not consist
+            if (!is_consistent(hypothesis_color))
+                continue;
+
+            float hypothesis_coordinates[4];
+            color_coordinates(hypothesis_color, metric, hypothesis_coordinates);
+
+            // mean color of the views which see the voxel
+            float mean[4] = {hypothesis_coordinates[0], hypothesis_coordinates[1],
+                             hypothesis_coordinates[2], hypothesis_coordinates[3]};
+            size_t number_of_colors = 1;
+
+            size_t voxel_position[3] = {voxel_index % dimensions[0],
+                                        (voxel_index / dimensions[0]) % dimensions[1],
+                                        voxel_index / (dimensions[0]*dimensions[1])};
+
+            float voxel_position_3d[4] = {bounding_box[0] + ((float)voxel_position[0] + 0.5f)*bounding_box[3]/(float)dimensions[0],
+                                          bounding_box[1] + ((float)voxel_position[1] + 0.5f)*bounding_box[4]/(float)dimensions[1],
+                                          bounding_box[2] + ((float)voxel_position[2] + 0.5f)*bounding_box[5]/(float)dimensions[2],
+                                          1.0f};
+
+            unsigned char consistent = 0;
+            for (size_t i = 0; i < scene.number_of_images && consistent == 0; ++i)
+            {
+                if (i == current_image_number)
+                    continue;
+
+                float pos_at_second_image[4];
+                mul_mat_vec(&scene.projection_matrices[i*16], voxel_position_3d, pos_at_second_image);
+
+                float pos_x = pos_at_second_image[0]/pos_at_second_image[2];
+                float pos_y = pos_at_second_image[1]/pos_at_second_image[2];
+
+                if (!is_in_image(pos_x, pos_y, width, height))
+                    continue;
+
+                size_t z_buffer_offset_second = (size_t)floorf(pos_x) +
+                                                (size_t)floorf(pos_y)*width +
+                                                i*width*height;
+
+                // in z buffer we have the same voxel as current
+                if (z_buffer[z_buffer_offset_second] == voxel_index)
+                {
+                    float coordinates[4];
+                    color_coordinates(voxel + (1 + i)*4, metric, coordinates);
+
+                    if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+                    {
+                        if (!is_empty_color(coordinates))
+                        {
+                            for (size_t c = 0; c < 4; ++c)
+                                mean[c] += coordinates[c];
+                            number_of_colors++;
+                        }
+                    }
+                    else if (color_difference(coordinates, hypothesis_coordinates, metric) < threshold)
+                        consistent = 1;
+                }
+            }
+
+            if (metric == NATIVE_COLOR_METRIC_VARIANCE)
+            {
+                for (size_t c = 0; c < 4; ++c)
+                    mean[c] /= (float)number_of_colors;
+
+                consistent = number_of_colors > 1 &&
+                             color_difference(hypothesis_coordinates, mean, metric) < threshold;
+            }
+
+            consistency[x + y*width] = consistent;
+        }
+    });
+
+    // hypothesis is not consistent
+    for (size_t pixel = 0; pixel < width*height; ++pixel)
+        if (consistency[pixel] == 0)
+            memset(&hypotheses[(current_z_buffer[pixel]*hypotheses_size + 1 + current_image_number)*4], 0, 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! step 4: build voxel model from variety of hypotheses
+///////////////////////////////////////////////////////////////////////////////
+void NativeBackend::run_step_4(unsigned char * voxel_model)
+{
+    std::cout << "Run step 4..." << std::endl;
+
+    const size_t hypotheses_size = 1 + scene.number_of_images;
+
+    thread_pool->run(scene.dimensions[1]*scene.dimensions[2], [&](size_t row)
+    {
+        for (size_t x = 0; x < scene.dimensions[0]; ++x)
+        {
+            const size_t voxel_index = x + row*scene.dimensions[0];
+            const unsigned char * voxel = &hypotheses[voxel_index*hypotheses_size*4];
+            unsigned char * result = &voxel_model[voxel_index*4];
+
+            memset(result, 0, 4);
+
+            // if voxel is not visible
+            if (voxel[0] == 0)
+                continue;
+
+            unsigned int result_color[4] = {0, 0, 0, 0};
+            unsigned int result_number_of_hypotheses = 0;
+
+            for (size_t i = 0; i < scene.number_of_images; ++i)
+            {
+                const unsigned char * color = voxel + (1 + i)*4;
+
+                // if hypothesis is consistent
+                if (is_consistent(color))
+                {
+                    for (size_t c = 0; c < 4; ++c)
+                        result_color[c] += color[c];
+                    result_number_of_hypotheses++;
+                }
+            }
+
+            if (result_number_of_hypotheses == 0)
+                continue;
+
+            result[1] = (unsigned char)(result_color[0] / result_number_of_hypotheses);
+            result[2] = (unsigned char)(result_color[1] / result_number_of_hypotheses);
+            result[3] = (unsigned char)(result_color[2] / result_number_of_hypotheses);
+        }
+    });
+}
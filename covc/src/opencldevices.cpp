@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "opencldevices.h"
+
+#include <algorithm>
+#include <iostream>
+
+// cl_ext_device_fission, cl.hpp and 1.1 headers don't declare it
+typedef cl_ulong cl_device_partition_property_ext;
+typedef CL_API_ENTRY cl_int (CL_API_CALL * clCreateSubDevicesEXT_fn)(cl_device_id,
+                                                                   const cl_device_partition_property_ext *,
+                                                                   cl_uint,
+                                                                   cl_device_id *,
+                                                                   cl_uint *);
+
+namespace
+{
+
+const cl_device_partition_property_ext partition_by_affinity_domain_ext = 0x4053;
+const cl_device_partition_property_ext affinity_domain_numa_ext = 0x10;
+const cl_device_partition_property_ext properties_list_end_ext = 0;
+
+bool has_greater_score(const OpenCLDevice & a, const OpenCLDevice & b)
+{
+    return a.score > b.score;
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+//! Query device properties and score it
+///////////////////////////////////////////////////////////////////////////////
+OpenCLDevice describe_opencl_device(const cl::Device & _device)
+{
+    OpenCLDevice device;
+    device.device = _device;
+    device.platform = cl::Platform(_device.getInfo<CL_DEVICE_PLATFORM>());
+    device.platform_name = device.platform.getInfo<CL_PLATFORM_NAME>();
+    device.name = _device.getInfo<CL_DEVICE_NAME>();
+    device.vendor = _device.getInfo<CL_DEVICE_VENDOR>();
+    device.driver_version = _device.getInfo<CL_DRIVER_VERSION>();
+    device.type = _device.getInfo<CL_DEVICE_TYPE>();
+    device.compute_units = _device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    device.max_clock_frequency = _device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+    device.global_memory_size = _device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    device.image_support = _device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+
+    device.score = 0.0;
+    if (_device.getInfo<CL_DEVICE_AVAILABLE>() == CL_TRUE &&
+        _device.getInfo<CL_DEVICE_COMPILER_AVAILABLE>() == CL_TRUE)
+        device.score = score_opencl_device(device);
+
+    return device;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! List devices of all types on all OpenCL platforms.
+//!
+//! @return devices sorted by score, the fastest first. Platforms which fail
+//! to report their devices are skipped.
+///////////////////////////////////////////////////////////////////////////////
+std::vector<OpenCLDevice> get_opencl_devices()
+{
+    std::vector<OpenCLDevice> result;
+
+    std::vector<cl::Platform> platforms;
+    try
+    {
+        cl::Platform::get(&platforms);
+    }
+    catch(cl::Error ex)
+    {
+        std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
+        return result;
+    }
+
+    for (size_t i = 0; i < platforms.size(); ++i)
+    {
+        try
+        {
+            std::vector<cl::Device> devices;
+            platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+
+            for (size_t j = 0; j < devices.size(); ++j)
+                result.push_back(describe_opencl_device(devices[j]));
+        }
+        catch(cl::Error ex)
+        {
+            std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
+        }
+    }
+
+    std::stable_sort(result.begin(), result.end(), has_greater_score);
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Estimate device speed.
+//!
+//! Score is compute units times clock frequency. A GPU or accelerator compute
+//! unit runs many work items at once, so it counts as 16 CPU cores. Devices
+//! with less than 1 GB of global memory are penalized in proportion.
+//!
+//! @return score, 0 if device can't run voxel colorer (no image support)
+///////////////////////////////////////////////////////////////////////////////
+double score_opencl_device(const OpenCLDevice & device)
+{
+    // step 1 reads images through image3d_t
+    if (!device.image_support)
+        return 0.0;
+
+    double score = (double)device.compute_units * (double)std::max(device.max_clock_frequency, (cl_uint)1);
+
+    if (device.type & (CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR))
+        score *= 16.0;
+
+    const double gigabyte = 1024.0*1024.0*1024.0;
+    if ((double)device.global_memory_size < gigabyte)
+        score *= (double)device.global_memory_size / gigabyte;
+
+    return score;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Split device into sub-devices, one per NUMA node, with
+//! cl_ext_device_fission. Every sub-device can get its own slab of voxel
+//! grid (see VoxelColorer::set_devices()), so memory of every socket is used.
+//!
+//! Sub-devices are never released, split a device once and keep them.
+//!
+//! @return sub-devices, or the device itself if it can't be split
+///////////////////////////////////////////////////////////////////////////////
+std::vector<cl::Device> split_opencl_device_by_numa(const cl::Device & device)
+{
+    std::vector<cl::Device> result(1, device);
+
+    try
+    {
+        if (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_ext_device_fission") == std::string::npos)
+            return result;
+    }
+    catch(cl::Error ex)
+    {
+        std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
+        return result;
+    }
+
+    clCreateSubDevicesEXT_fn create_sub_devices =
+        reinterpret_cast<clCreateSubDevicesEXT_fn>(clGetExtensionFunctionAddress("clCreateSubDevicesEXT"));
+    if (!create_sub_devices)
+        return result;
+
+    const cl_device_partition_property_ext properties[] = {
+        partition_by_affinity_domain_ext,
+        affinity_domain_numa_ext,
+        properties_list_end_ext
+    };
+
+    cl_uint number_of_sub_devices = 0;
+    if (create_sub_devices(device(), properties, 0, NULL, &number_of_sub_devices) != CL_SUCCESS ||
+        number_of_sub_devices < 2)
+        return result;
+
+    std::vector<cl_device_id> sub_devices(number_of_sub_devices);
+    if (create_sub_devices(device(), properties, number_of_sub_devices, &sub_devices[0], NULL) != CL_SUCCESS)
+        return result;
+
+    result.clear();
+    for (size_t i = 0; i < sub_devices.size(); ++i)
+        result.push_back(cl::Device(sub_devices[i]));
+
+    return result;
+}
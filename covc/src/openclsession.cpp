@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "openclsession.h"
+
+#include <algorithm>
+
+namespace
+{
+
+//! flags of OpenCLSession::SessionBuffer buffers
+const cl_mem_flags buffer_flags[] = {
+    CL_MEM_READ_ONLY,                           // dimensions
+    CL_MEM_READ_ONLY,                           // bounding box
+    CL_MEM_READ_ONLY,                           // projection matrices
+    CL_MEM_READ_ONLY,                           // unprojection matrices
+    CL_MEM_READ_ONLY,                           // image calibration matrices
+    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,  // hypotheses
+    CL_MEM_READ_WRITE,                          // chromaticities of hypotheses
+    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,  // iteration info, read by host
+    CL_MEM_READ_WRITE,                          // lists of visible voxels
+    CL_MEM_READ_WRITE,                          // sizes of lists
+    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,  // z buffer
+    CL_MEM_READ_WRITE,                          // z depth of every view
+    CL_MEM_READ_WRITE,                          // rejected pixels of every view
+    CL_MEM_READ_WRITE,                          // views which see every voxel
+    CL_MEM_WRITE_ONLY                           // voxel model
+};
+
+//! number of views uploaded at once. depth of 3D image must be at least 2,
+//! so the single view left at the end joins the previous chunk
+const size_t images_per_chunk = 8;
+
+///////////////////////////////////////////////////////////////////////////////
+//! Split views into chunks
+//!
+//! @param number_of_images Number of images
+//! @param first_images Receives first view of every chunk and number of
+//! images after the last one
+///////////////////////////////////////////////////////////////////////////////
+void split_into_chunks(size_t number_of_images, std::vector<size_t> & first_images)
+{
+    first_images.clear();
+
+    for (size_t i = 0; i < number_of_images; i += images_per_chunk)
+    {
+        if (number_of_images - i == 1 && i != 0)
+            break;
+        first_images.push_back(i);
+    }
+
+    first_images.push_back(number_of_images);
+}
+
+} // namespace
+
+OpenCLSession::OpenCLSession()
+    :images_width(0),
+    images_height(0),
+    number_of_allocations(0)
+{
+    for (size_t i = 0; i < NUMBER_OF_BUFFERS; ++i)
+        capacities[i] = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Free all buffers. Next reserve() allocates them again.
+///////////////////////////////////////////////////////////////////////////////
+void OpenCLSession::release()
+{
+    for (size_t i = 0; i < NUMBER_OF_BUFFERS; ++i)
+    {
+        buffers[i] = cl::Buffer();
+        capacities[i] = 0;
+    }
+
+    image_chunks.clear();
+    first_images.clear();
+    images_width = images_height = 0;
+
+    context = cl::Context();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Number of bricks of voxel cube of one scene, bricks at its far sides may
+//! be cut.
+//!
+//! @param dimensions Dimensions of resulting voxel cube of one scene by x, y, z
+///////////////////////////////////////////////////////////////////////////////
+size_t OpenCLSession::get_number_of_bricks(const size_t * dimensions)
+{
+    size_t result = 1;
+    for (size_t i = 0; i < 3; ++i)
+        result *= (dimensions[i] + brick_size - 1)/brick_size;
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Make buffers big enough for the batch of scenes. Buffers created for
+//! another context are dropped.
+//!
+//! @param context Context of command queue which will use buffers
+//! @param dimensions Dimensions of resulting voxel cube of one scene by x, y, z
+//! @param number_of_scenes Number of scenes in the batch
+//! @param number_of_images Number of images of one scene
+//! @param width Width of images
+//! @param height Height of images
+//! @param chromaticities Chromaticities of hypotheses are precomputed. If not,
+//! the buffer is not allocated
+///////////////////////////////////////////////////////////////////////////////
+void OpenCLSession::reserve(const cl::Context & _context,
+                            const size_t * dimensions,
+                            size_t number_of_scenes,
+                            size_t number_of_images,
+                            size_t width,
+                            size_t height,
+                            bool chromaticities)
+{
+    if (context() != _context())
+    {
+        release();
+        context = _context;
+    }
+
+    size_t number_of_voxels = dimensions[0]*dimensions[1]*dimensions[2]*number_of_scenes;
+    size_t number_of_views = number_of_images*number_of_scenes;
+
+    reserve_buffer(BUFFER_DIMENSIONS, 3*sizeof(cl_uint));
+    reserve_buffer(BUFFER_BOUNDING_BOX, number_of_scenes*6*sizeof(float));
+    reserve_buffer(BUFFER_PROJECTION_MATRICES, number_of_views*16*sizeof(float));
+    reserve_buffer(BUFFER_UNPROJECTION_MATRICES, number_of_views*16*sizeof(float));
+    reserve_buffer(BUFFER_IMAGE_CALIBRATION_MATRICES, number_of_views*16*sizeof(float));
+    reserve_buffer(BUFFER_HYPOTHESES, number_of_voxels*(4*sizeof(unsigned char) + number_of_images*4*sizeof(unsigned char)));
+    if (chromaticities)
+        reserve_buffer(BUFFER_CHROMATICITIES, number_of_voxels*number_of_images*2*sizeof(cl_ushort));
+    reserve_buffer(BUFFER_ITERATION_INFO, max_iterations_in_flight*iteration_info_size*sizeof(cl_uint));
+    reserve_buffer(BUFFER_VISIBLE_VOXELS, number_of_lists*number_of_voxels*sizeof(cl_uint));
+    reserve_buffer(BUFFER_LIST_SIZES, (number_of_lists + number_of_voxels)*sizeof(cl_uint));
+    reserve_buffer(BUFFER_Z_BUFFER, width*height*number_of_views*4*sizeof(unsigned char));
+    reserve_buffer(BUFFER_Z_DEPTH, width*height*number_of_views*sizeof(cl_int));
+    reserve_buffer(BUFFER_REJECTIONS, width*height*number_of_views*sizeof(cl_uchar));
+    reserve_buffer(BUFFER_VIEWS_OF_VOXELS, number_of_voxels*2*sizeof(cl_uint));
+    reserve_buffer(BUFFER_OCCUPANCY, get_number_of_bricks(dimensions)*number_of_scenes*sizeof(cl_uchar));
+    reserve_buffer(BUFFER_VOXEL_MODEL, number_of_voxels*4*sizeof(unsigned char));
+
+    // step 1 takes image size from the image, so chunks are recreated if
+    // size or split of views is changed
+    std::vector<size_t> new_first_images;
+    split_into_chunks(number_of_views, new_first_images);
+
+    if (images_width != width || images_height != height || first_images != new_first_images)
+    {
+        image_chunks.clear();
+
+        for (size_t i = 0; i + 1 < new_first_images.size(); ++i)
+        {
+            image_chunks.push_back(cl::Image3D(context,
+                                               CL_MEM_READ_ONLY,
+                                               cl::ImageFormat(CL_ARGB, CL_UNSIGNED_INT8),
+                                               width,
+                                               height,
+                                               new_first_images[i + 1] - new_first_images[i],
+                                               0,
+                                               0));
+            number_of_allocations++;
+        }
+
+        first_images.swap(new_first_images);
+        images_width = width;
+        images_height = height;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Chunk which holds view
+//!
+//! @param image Number of view
+///////////////////////////////////////////////////////////////////////////////
+size_t OpenCLSession::get_chunk_of_image(size_t image) const
+{
+    return std::upper_bound(first_images.begin(), first_images.end() - 1, image) - first_images.begin() - 1;
+}
+
+void OpenCLSession::reserve_buffer(SessionBuffer buffer, size_t size)
+{
+    if (size <= capacities[buffer])
+        return;
+
+    buffers[buffer] = cl::Buffer(context, buffer_flags[buffer], size);
+    capacities[buffer] = size;
+    number_of_allocations++;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "programcache.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+    #include <direct.h>
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <unistd.h>
+#endif
+
+namespace
+{
+
+const char cache_file_magic[] = "COVC program binary 1";
+
+///////////////////////////////////////////////////////////////////////////////
+//! 64 bit FNV-1a hash
+///////////////////////////////////////////////////////////////////////////////
+unsigned long long hash(const std::string & data)
+{
+    unsigned long long result = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        result ^= (unsigned char)data[i];
+        result *= 1099511628211ULL;
+    }
+
+    return result;
+}
+
+std::string to_hex(unsigned long long value)
+{
+    char buffer[17];
+    sprintf(buffer, "%016llx", value);
+    return buffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Read entry in cache file format: magic, key size, key, binary.
+//!
+//! @return true if entry has the key and non empty binary
+///////////////////////////////////////////////////////////////////////////////
+bool read_entry(std::istream & stream, const std::string & key, std::string & binary)
+{
+    std::string magic;
+    size_t key_size = 0;
+    std::getline(stream, magic);
+    stream >> key_size;
+    stream.get();
+
+    if (!stream || magic != cache_file_magic || key_size != key.size())
+        return false;
+
+    std::string entry_key(key_size, '\0');
+    stream.read(&entry_key[0], key_size);
+    if (!stream || entry_key != key)
+        return false;
+
+    std::stringstream ss;
+    ss << stream.rdbuf();
+    binary = ss.str();
+
+    return !binary.empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Create directory and all its parents
+///////////////////////////////////////////////////////////////////////////////
+void make_directories(const std::string & path)
+{
+    for (size_t i = 1; i <= path.size(); ++i)
+    {
+        if (i != path.size() && path[i] != '/' && path[i] != '\\')
+            continue;
+
+        std::string directory = path.substr(0, i);
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+}
+
+} // namespace
+
+ProgramCache::ProgramCache()
+    :directory(default_directory())
+{
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Add entry built in advance.
+//!
+//! @param entry Entry in cache file format. Must live as long as the cache
+//! @param size Size of entry
+///////////////////////////////////////////////////////////////////////////////
+void ProgramCache::add_prebuilt(const unsigned char * entry, size_t size)
+{
+    prebuilt_entries.push_back(std::make_pair(entry, size));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Build program for device, using prebuilt or cached binary if there is one.
+//!
+//! @param context Context of device
+//! @param device Device to build program for
+//! @param source Program source
+//! @param options Build options
+//! @return built program
+///////////////////////////////////////////////////////////////////////////////
+cl::Program ProgramCache::build(const cl::Context & context,
+                                const cl::Device & device,
+                                const std::string & source,
+                                const std::string & options)
+{
+    if (directory.empty() && prebuilt_entries.empty())
+        return build_from_source(context, device, source, options);
+
+    std::string program_key = key(device, source, options);
+    std::string binary;
+
+    for (size_t i = 0; i < prebuilt_entries.size(); ++i)
+    {
+        std::istringstream entry(std::string((const char *)prebuilt_entries[i].first, prebuilt_entries[i].second));
+
+        if (read_entry(entry, program_key, binary))
+        {
+            try
+            {
+                return build_from_binary(context, device, binary, options);
+            }
+            catch(cl::Error ex)
+            {
+                std::cerr << "COVC: Prebuilt program binary is rejected: " << ex.what() << "(" << ex.error() << ")" << std::endl;
+            }
+        }
+    }
+
+    if (directory.empty())
+        return build_from_source(context, device, source, options);
+
+    if (load(program_key, binary))
+    {
+        try
+        {
+            return build_from_binary(context, device, binary, options);
+        }
+        catch(cl::Error ex)
+        {
+            std::cerr << "COVC: Cached program binary is rejected: " << ex.what() << "(" << ex.error() << ")" << std::endl;
+        }
+    }
+
+    cl::Program program = build_from_source(context, device, source, options);
+    save(program_key, device, program);
+
+    return program;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Write binary of built program to cache directory
+///////////////////////////////////////////////////////////////////////////////
+void ProgramCache::store(const cl::Device & device,
+                         const std::string & source,
+                         const std::string & options,
+                         const cl::Program & program) const
+{
+    if (!directory.empty())
+        save(key(device, source, options), device, program);
+}
+
+cl::Program ProgramCache::build_from_binary(const cl::Context & context,
+                                            const cl::Device & device,
+                                            const std::string & binary,
+                                            const std::string & options)
+{
+    std::vector<cl::Device> devices(1, device);
+    cl::Program::Binaries binaries(1, std::make_pair(binary.data(), binary.size()));
+
+    cl::Program program(context, devices, binaries);
+    program.build(devices, options.c_str());
+
+    return program;
+}
+
+cl::Program ProgramCache::build_from_source(const cl::Context & context,
+                                            const cl::Device & device,
+                                            const std::string & source,
+                                            const std::string & options)
+{
+    cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.length()));
+    cl::Program program(context, sources);
+
+    try
+    {
+        program.build(std::vector<cl::Device>(1, device), options.c_str());
+    }
+    catch(cl::Error ex)
+    {
+        std::cerr << "COVC: OpenCL Program Build Info:" << std::endl;
+        std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        throw;
+    }
+
+    return program;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Default cache directory: $COVC_CACHE_DIR, $XDG_CACHE_HOME/covc or
+//! $HOME/.cache/covc. Empty COVC_CACHE_DIR disables cache.
+///////////////////////////////////////////////////////////////////////////////
+std::string ProgramCache::default_directory()
+{
+    const char * path = getenv("COVC_CACHE_DIR");
+    if (path)
+        return path;
+
+    path = getenv("XDG_CACHE_HOME");
+    if (path && *path)
+        return std::string(path) + "/covc";
+
+#ifdef _WIN32
+    path = getenv("LOCALAPPDATA");
+    if (path && *path)
+        return std::string(path) + "\\covc";
+#else
+    path = getenv("HOME");
+    if (path && *path)
+        return std::string(path) + "/.cache/covc";
+#endif
+
+    return std::string();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Everything the compiled binary depends on
+///////////////////////////////////////////////////////////////////////////////
+std::string ProgramCache::key(const cl::Device & device,
+                              const std::string & source,
+                              const std::string & options)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+    std::stringstream ss;
+    ss << "platform=" << platform.getInfo<CL_PLATFORM_NAME>() << " " << platform.getInfo<CL_PLATFORM_VERSION>() << "\n";
+    ss << "device=" << device.getInfo<CL_DEVICE_VENDOR>() << " " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+    ss << "device_version=" << device.getInfo<CL_DEVICE_VERSION>() << "\n";
+    ss << "driver_version=" << device.getInfo<CL_DRIVER_VERSION>() << "\n";
+    ss << "options=" << options << "\n";
+    ss << "source=" << to_hex(hash(source)) << "\n";
+
+    return ss.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Read cached binary
+//!
+//! @return true if there is binary for key
+///////////////////////////////////////////////////////////////////////////////
+bool ProgramCache::load(const std::string & key, std::string & binary) const
+{
+    std::ifstream file((directory + "/" + to_hex(hash(key)) + ".bin").c_str(), std::ios::binary);
+    if (!file)
+        return false;
+
+    return read_entry(file, key, binary);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Write binary of built program to cache. The file is written under
+//! temporary name and renamed, so concurrent processes never read a part.
+///////////////////////////////////////////////////////////////////////////////
+void ProgramCache::save(const std::string & key, const cl::Device & device, const cl::Program & program) const
+{
+    // program of context with several devices has a binary per device,
+    // only the one of given device is built
+    cl_uint number_of_devices = 0;
+    if (clGetProgramInfo(program(), CL_PROGRAM_NUM_DEVICES, sizeof(number_of_devices), &number_of_devices, NULL) != CL_SUCCESS ||
+        number_of_devices == 0)
+        return;
+
+    std::vector<cl_device_id> devices(number_of_devices);
+    std::vector<size_t> binary_sizes(number_of_devices);
+    if (clGetProgramInfo(program(), CL_PROGRAM_DEVICES, number_of_devices*sizeof(cl_device_id), &devices[0], NULL) != CL_SUCCESS ||
+        clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, number_of_devices*sizeof(size_t), &binary_sizes[0], NULL) != CL_SUCCESS)
+        return;
+
+    size_t device_index = std::find(devices.begin(), devices.end(), device()) - devices.begin();
+    if (device_index == devices.size() || binary_sizes[device_index] == 0)
+        return;
+
+    std::vector<std::string> binaries(number_of_devices);
+    std::vector<unsigned char *> binaries_data(number_of_devices, (unsigned char *)NULL);
+    binaries[device_index].resize(binary_sizes[device_index]);
+    binaries_data[device_index] = reinterpret_cast<unsigned char *>(&binaries[device_index][0]);
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, number_of_devices*sizeof(unsigned char *), &binaries_data[0], NULL) != CL_SUCCESS)
+        return;
+
+    const std::string & binary = binaries[device_index];
+
+    make_directories(directory);
+
+    std::string path = directory + "/" + to_hex(hash(key)) + ".bin";
+    std::stringstream temporary_path;
+    temporary_path << path << "." << getpid() << "." << (const void *)this << ".tmp";
+
+    {
+        std::ofstream file(temporary_path.str().c_str(), std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "COVC: Can't write program cache to " << directory << std::endl;
+            return;
+        }
+
+        file << cache_file_magic << "\n" << key.size() << "\n" << key << binary;
+    }
+
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (rename(temporary_path.str().c_str(), path.c_str()) != 0)
+        remove(temporary_path.str().c_str());
+}
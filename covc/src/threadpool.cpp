@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2010 Alexey 'l1feh4ck3r' Antonov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "threadpool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//! Create thread pool
+//!
+//! @param number_of_threads Number of threads, 0 - one per hardware thread
+///////////////////////////////////////////////////////////////////////////////
+ThreadPool::ThreadPool(size_t number_of_threads)
+    :task(0),
+    number_of_tasks(0),
+    next_task(0),
+    number_of_busy_workers(0),
+    job_number(0),
+    stop(false)
+{
+    if (number_of_threads == 0)
+        number_of_threads = std::thread::hardware_concurrency();
+
+    for (size_t i = 1; i < number_of_threads; ++i)
+        workers.push_back(std::thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+    }
+    job_started.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Execute task for every index in [0, number_of_tasks) and wait for all of
+//! them.
+//!
+//! @param number_of_tasks Number of task indices
+//! @param task Task. Must be safe to call concurrently for different indices
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::run(size_t _number_of_tasks, const std::function<void (size_t)> & _task)
+{
+    if (_number_of_tasks == 0)
+        return;
+
+    if (workers.empty() || _number_of_tasks == 1)
+    {
+        for (size_t i = 0; i < _number_of_tasks; ++i)
+            _task(i);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        task = &_task;
+        number_of_tasks = _number_of_tasks;
+        next_task = 0;
+        number_of_busy_workers = workers.size();
+        job_number++;
+    }
+    job_started.notify_all();
+
+    execute_tasks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (number_of_busy_workers != 0)
+        job_finished.wait(lock);
+
+    task = 0;
+}
+
+void ThreadPool::execute_tasks()
+{
+    for (size_t i = next_task++; i < number_of_tasks; i = next_task++)
+        (*task)(i);
+}
+
+void ThreadPool::worker()
+{
+    size_t last_job_number = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stop && job_number == last_job_number)
+                job_started.wait(lock);
+
+            if (stop)
+                return;
+
+            last_job_number = job_number;
+        }
+
+        execute_tasks();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (--number_of_busy_workers == 0)
+                job_finished.notify_one();
+        }
+    }
+}
@@ -22,43 +22,182 @@
 
 #include "voxelcolorer.h"
 #include "matrices_and_vectors.h"
+#include "oclsources.h"
 
-#include <fstream>
-#include <sstream>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 
 #include <limits.h>
 
 #include <math.h>
 
+namespace
+{
+
+//! embedded sources (see covc/ocl) of VoxelColorer::OpenCLProgram programs
+const char * const program_names[] = {
+    "step_1_build_variety_of_hypotheses.cl",
+    "step_2_initial_inconsistent_hypotheses_rejection_by_hypotheses.cl",
+    "step_2_3_calculate_iteration_info.cl",
+    "step_2_3_compact_visible_voxels.cl",
+    "step_3_inconsistent_voxels_rejection.cl",
+    "step_3_build_occupancy.cl",
+    "step_4_build_voxel_model_from_variety_of_hypotheses.cl"
+};
+
+const char * const program_build_options = "-cl-mad-enable";
+
+//! defines of VoxelColorer::ColorMetric metrics in ocl/ programs
+const char * const color_metric_defines[] = {
+    "",
+    " -D COVC_METRIC_SQUARED_DISTANCE",
+    " -D COVC_METRIC_CHROMATICITY",
+    " -D COVC_METRIC_CIELAB",
+    " -D COVC_METRIC_VARIANCE"
+};
+
+//! the biggest work group of kernels which share voxels in local memory
+const size_t max_local_work_size = 256;
+
+///////////////////////////////////////////////////////////////////////////////
+//! Number of voxels whose hypotheses are taken by one work group of kernel.
+//! Work group size must divide global size by x, dimension_x*number_of_images.
+//!
+//! @return 0 if hypotheses of one voxel don't fit into work group
+///////////////////////////////////////////////////////////////////////////////
+size_t get_voxels_per_work_group(const cl::Kernel & kernel, const cl::Device & device,
+                                 size_t number_of_images, size_t dimension_x)
+{
+    size_t work_group_size = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), max_local_work_size);
+    cl_ulong local_memory_size = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                                 kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+
+    size_t result = 0;
+    for (size_t i = 1; i <= dimension_x && i*number_of_images <= work_group_size; ++i)
+    {
+        if (dimension_x % i == 0 && i*number_of_images*4*sizeof(cl_float) <= local_memory_size)
+            result = i;
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Local size of kernels which reduce work group in local memory: the
+//! biggest power of two the kernel can be run with
+///////////////////////////////////////////////////////////////////////////////
+size_t get_reduction_work_group_size(const cl::Kernel & kernel, const cl::Device & device)
+{
+    size_t work_group_size = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), max_local_work_size);
+
+    size_t result = 1;
+    while (result*2 <= work_group_size)
+        result *= 2;
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Global size of 1D kernel: size rounded up to a multiple of work group
+//! size, at least one work group
+///////////////////////////////////////////////////////////////////////////////
+size_t round_up_to_work_groups(size_t size, size_t work_group_size)
+{
+    return (std::max(size, (size_t)1) + work_group_size - 1)/work_group_size*work_group_size;
+}
+
+//! iteration info is zeroed before work groups add their sums to it
+const cl_uint zero_iteration_info[OpenCLSession::iteration_info_size] = {0, 0, 0, 0};
+
+//! first iteration of step 3 runs whatever changed flags are
+const cl_uint no_previous_iteration = UINT_MAX;
+
+//! kernels go through all voxels of the slab instead of list of visible ones
+const cl_uint no_list = UINT_MAX;
+
+//! views of a voxel checked by check_voxel_consistency kernel are bits of
+//! two cl_uint, passed to ocl/ programs as MAX_VIEWS_OF_VOXEL
+const size_t max_views_of_voxel = 64;
+
+} // namespace
+
 
 VoxelColorer::VoxelColorer()
-    :width(0), height(0),
+    :backend(BACKEND_AUTO),
+    precomputed_chromaticities(false),
+    ocl_chromaticities(false),
+    batched_views(false),
+    consistency_by_voxels(false),
+    color_metric(COLOR_METRIC_NORMALIZED_RGB),
+    number_of_slices(0),
+    ocl_visible_voxels_list(0),
+    ocl_staging_size(0),
+    images_on_devices(false),
+    width(0), height(0),
     number_of_images(0),
     number_of_last_added_image(0),
-    threshold(0.001f),
-    precision(10.0f)
+    threshold(0.001f)
 {
     memset(dimensions, 0, sizeof(dimensions));
     memset(camera_calibration_matrix, 0, sizeof(camera_calibration_matrix));
     memset(bounding_box, 0, sizeof(bounding_box));
+    memset(ocl_dimensions, 0, sizeof(ocl_dimensions));
+    memset(ocl_staging_pointers, 0, sizeof(ocl_staging_pointers));
+
+    // binaries precompiled at build time (COVC_PRECOMPILE_KERNELS)
+    for (const EmbeddedFile * binary = embedded_ocl_binaries; binary->name; ++binary)
+        program_cache.add_prebuilt(binary->data, binary->size);
 }
 
 VoxelColorer::~VoxelColorer()
 {
-
+    release_staging();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//! Add next image
+//!
+//! If OpenCL is prepared, the image goes to devices at once and is not kept
+//! on host. Otherwise it is kept on host till the voxel model is built.
+//! Streamed images are kept in image chunks of their size, so images of
+//! another size are rejected till set_number_of_images() starts over.
+//!
+//! @param image Image in ARGB. The caller may reuse it after return
+///////////////////////////////////////////////////////////////////////////////
 void VoxelColorer::add_image(const unsigned char * image, size_t _width, size_t _height, const float * image_calibration_matrix)
 {
+    if (number_of_last_added_image >= number_of_images)
+    {
+        std::cerr << "COVC: All " << number_of_images << " images are added already" << std::endl;
+        return;
+    }
+
+    if (images_on_devices && (_width != width || _height != height))
+    {
+        std::cerr << "COVC: Images streamed to OpenCL devices are " << width << "x" << height
+                  << ", image " << _width << "x" << _height << " is not added" << std::endl;
+        return;
+    }
+
     width = _width;
     height = _height;
 
-    for (size_t i = 0; i < width*height*4; ++i)
-        pixels.data()[number_of_last_added_image*width*height + i] = image[i];
+    // image which failed to upload is not counted, so build is refused till
+    // it is added again
+    if (!ocl_slabs.empty() && backend != BACKEND_NATIVE)
+    {
+        if (!stream_image(image))
+            return;
+    }
+    else
+    {
+        pixels.resize(number_of_images*width*height*4);
+        memcpy(&pixels[number_of_last_added_image*width*height*4], image, width*height*4);
+    }
 
     for (size_t i = 0; i < 16; ++i)
-        image_calibration_matrices[number_of_last_added_image][i] = image_calibration_matrix[i];
+        image_calibration_matrices[number_of_last_added_image*16 + i] = image_calibration_matrix[i];
 
     calculate_projection_matrix();
 
@@ -70,140 +209,276 @@ void VoxelColorer::add_image(const unsigned char * image, size_t _width, size_t
 ///////////////////////////////////////////////////////////////////////////////
 bool VoxelColorer::build_voxel_model()
 {
-    unsigned int iteration_info[2];
-    iteration_info[0] = 0;
-    iteration_info[1] = 0;
+    return build_batch(std::vector<VoxelColorer *>(1, this));
+}
 
-    calculate_bounding_box();
-    calculate_unprojection_matrices();
+///////////////////////////////////////////////////////////////////////////////
+//! Build voxel models of several scenes with devices and programs of this
+//! voxel colorer.
+//!
+//! Scenes are set up as usual by set_number_of_images(), add_image() and so
+//! on, but only this voxel colorer has to be prepared. Scenes of the same
+//! shape are built together: their voxel grids are stacked in shared buffers
+//! and every step is run once for all of them. The result of every scene is
+//! taken by its get_voxel_model(). Scenes which streamed their images by
+//! add_image() are built alone, each with the devices it streamed them to.
+//!
+//! If this voxel colorer streamed its images, they are in image chunks of its
+//! sessions, which the other batches would overwrite. Such a call is
+//! rejected, the scene is built by build_voxel_model() first.
+//!
+//! @param scenes Scenes to build, this voxel colorer may be one of them
+//! @return false if any of scenes was not built
+///////////////////////////////////////////////////////////////////////////////
+bool VoxelColorer::build_voxel_models(const std::vector<VoxelColorer *> & scenes)
+{
+    bool result = true;
+    std::vector<bool> is_built(scenes.size(), false);
 
-    step_size = (float)(bounding_box[3] + bounding_box[4] + bounding_box[5])/(3.0f*precision);
+    if (images_on_devices)
+    {
+        for (size_t i = 0; i < scenes.size(); ++i)
+        {
+            if (scenes[i] != this && !scenes[i]->images_on_devices)
+            {
+                std::cerr << "COVC: Images were streamed to OpenCL devices of this voxel colorer, "
+                          << "other scenes can't be built with them" << std::endl;
+                return false;
+            }
+        }
+    }
 
-    std::cout << "Step size = " << step_size << std::endl;
+    for (size_t i = 0; i < scenes.size(); ++i)
+    {
+        if (is_built[i])
+            continue;
 
-    ///////////////////////////////////////////////////////////////////////////////
-    //! Create buffers
-    ///////////////////////////////////////////////////////////////////////////////
+        // images of the scene are already on devices of its own
+        if (scenes[i]->images_on_devices)
+        {
+            is_built[i] = true;
+            if (!scenes[i]->build_batch(std::vector<VoxelColorer *>(1, scenes[i])))
+                result = false;
+            continue;
+        }
 
-    cl::Buffer dimensions_buffer (ocl_context,
-                                  CL_MEM_READ_ONLY,
-                                  3*sizeof(size_t));
+        std::vector<VoxelColorer *> batch;
+        for (size_t j = i; j < scenes.size(); ++j)
+        {
+            if (!is_built[j] && !scenes[j]->images_on_devices && scenes[j]->has_same_shape(*scenes[i]))
+            {
+                batch.push_back(scenes[j]);
+                is_built[j] = true;
+            }
+        }
 
-    // create opencl buffer for projection matricies
-    cl::Buffer projection_matrices_buffer(ocl_context,
-                                          CL_MEM_READ_ONLY,
-                                          number_of_images*16*sizeof(float));
+        if (!build_batch(batch))
+            result = false;
+    }
 
-    // create opencl buffer for hypotheses
-    cl::Buffer hypotheses_buffer(ocl_context,
-                                 CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                                 dimensions[0]*dimensions[1]*dimensions[2]*
-                                 (4*sizeof(unsigned char)+number_of_images*4*sizeof(unsigned char)));
+    return result;
+}
 
-    cl::Buffer iteration_info_buffer(ocl_context,
-                                     CL_MEM_READ_WRITE,
-                                     sizeof(unsigned int)*2);
+///////////////////////////////////////////////////////////////////////////////
+//! Build voxel models of scenes of the same shape at once
+///////////////////////////////////////////////////////////////////////////////
+bool VoxelColorer::build_batch(const std::vector<VoxelColorer *> & batch)
+{
+    unsigned int iteration_info[2];
+    iteration_info[0] = 0;
+    iteration_info[1] = 0;
 
-    // create opencl buffer for bounding box
-    cl::Buffer bounding_box_buffer (ocl_context, CL_MEM_READ_ONLY, sizeof(bounding_box));
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i]->calculate_scene_parameters();
 
-    ///////////////////////////////////////////////////////////////////////////////
-    //! end of create buffers
-    ///////////////////////////////////////////////////////////////////////////////
+    if (backend == BACKEND_NATIVE)
+    {
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (batch[i]->images_on_devices)
+            {
+                std::cerr << "COVC: Images were streamed to OpenCL devices, native backend can't use them" << std::endl;
+                return false;
+            }
+        }
+
+        if (batched_views || consistency_by_voxels || precomputed_chromaticities)
+            std::cerr << "COVC: Native backend ignores batched views, consistency by voxels "
+                      << "and precomputed chromaticities" << std::endl;
+
+        // host threads are busy with one scene anyway
+        for (size_t i = 0; i < batch.size(); ++i)
+            build_voxel_model_native(*batch[i]);
+
+        return true;
+    }
+
+    if (!start_batch(batch))
+        return false;
+
+    run_step_1();
+    run_step_2(iteration_info);
+    run_step_3(iteration_info);
+    run_step_4();
 
-    std::vector<cl::Device> devices = ocl_context.getInfo<CL_CONTEXT_DEVICES>();
-    ocl_command_queue = cl::CommandQueue(ocl_context, devices[0]);
-
-
-    ocl_command_queue.enqueueWriteBuffer(bounding_box_buffer,
-                                         CL_TRUE,
-                                         0,
-                                         sizeof(bounding_box),
-                                         bounding_box);
-
-    ocl_command_queue.enqueueWriteBuffer(projection_matrices_buffer,
-                                         CL_TRUE,
-                                         0,
-                                         number_of_images*16*sizeof(float),
-                                         projection_matrices.data());
-
-    ocl_command_queue.enqueueWriteBuffer(dimensions_buffer,
-                                         CL_TRUE,
-                                         0,
-                                         3*sizeof(size_t),
-                                         dimensions);
-
-    std::cout << "Total number of hypotheses = " << dimensions[0]*dimensions[1]*dimensions[2]*number_of_images << std::endl;
-    std::cout << "Total number of voxels = " << dimensions[0]*dimensions[1]*dimensions[2] << std::endl;
-
-    run_step_1(bounding_box_buffer,
-               projection_matrices_buffer,
-               hypotheses_buffer,
-               dimensions_buffer);
-
-    cl::KernelFunctor step_2_3_1;
-    cl::KernelFunctor step_2_3_2;
-    build_step_2_3(hypotheses_buffer,
-                   dimensions_buffer,
-                   iteration_info_buffer,
-                   step_2_3_1,
-                   step_2_3_2);
-
-    run_step_2(hypotheses_buffer,
-               dimensions_buffer,
-               step_2_3_1,
-               step_2_3_2,
-               iteration_info_buffer,
-               iteration_info);
-
-    run_step_3(hypotheses_buffer,
-               bounding_box_buffer,
-               dimensions_buffer,
-               projection_matrices_buffer,
-               step_2_3_1,
-               step_2_3_2,
-               iteration_info_buffer,
-               iteration_info);
-
-    run_step_4(hypotheses_buffer,
-               dimensions_buffer);
+    ocl_batch.clear();
 
     return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//! Build the opencl program.
+//! Start build_voxel_model() on another thread.
+//!
+//! Voxel colorer must not be changed until the future is ready, the result
+//! is taken by get_voxel_model() as usual. Host can prepare the next job on
+//! another VoxelColorer meanwhile.
+///////////////////////////////////////////////////////////////////////////////
+std::future<bool> VoxelColorer::build_voxel_model_async()
+{
+    return std::async(std::launch::async, &VoxelColorer::build_voxel_model, this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Find out in one run what step 2 gives for every threshold of a list.
+//!
+//! Step 1 is run once, then every hypothesis gets the smallest difference to
+//! another hypothesis of its voxel by color metric. Step 2 keeps the
+//! hypothesis for every threshold above it, and keeps the voxel if it keeps
+//! any of its hypotheses, so the result for all thresholds is counted by one
+//! histogram. Visibility iterations of step 3 depend on threshold and are not
+//! run, voxel model is not changed.
 //!
-//! @param path to file with opencl program
+//! @param thresholds Thresholds in any order
+//! @param iteration_infos Receives number of consistent hypotheses and number
+//! of visible voxels after step 2 for every threshold
+//! @return false if the sweep was not run
 ///////////////////////////////////////////////////////////////////////////////
-void VoxelColorer::build_program(cl::Program & program, const std::string & path_to_file_with_program)
+bool VoxelColorer::sweep_thresholds(const std::vector<float> & thresholds, std::vector<unsigned int> & iteration_infos)
 {
-    std::ifstream file(path_to_file_with_program.data());
+    iteration_infos.assign(2*thresholds.size(), 0);
 
-    if ( !file )
+    if (thresholds.empty())
+        return true;
+
+    // bins of histogram are between ascending thresholds
+    std::vector<float> sorted_thresholds(thresholds);
+    std::sort(sorted_thresholds.begin(), sorted_thresholds.end());
+
+    std::vector<unsigned int> histogram(2*(sorted_thresholds.size() + 1), 0);
+
+    calculate_scene_parameters();
+
+    if (backend == BACKEND_NATIVE)
     {
-        std::cerr << "COVC: Error while opening " << path_to_file_with_program << std::endl;
-        throw std::exception();
+        if (images_on_devices)
+        {
+            std::cerr << "COVC: Images were streamed to OpenCL devices, native backend can't use them" << std::endl;
+            return false;
+        }
+
+        native_backend.calculate_threshold_histogram(get_native_scene(), sorted_thresholds, histogram.data());
     }
+    else
+    {
+        if (!start_batch(std::vector<VoxelColorer *>(1, this)))
+            return false;
 
-    std::stringstream ss;
-    ss << file.rdbuf();
-    file.close();
+        run_step_1();
+        run_threshold_sweep(sorted_thresholds, histogram.data());
 
-    bool result = false;
+        ocl_batch.clear();
+    }
 
-    std::vector<cl::Device> devices = ocl_context.getInfo<CL_CONTEXT_DEVICES>();
+    // threshold keeps hypotheses and voxels of its bin and of all bins below
+    for (size_t i = 0; i < thresholds.size(); ++i)
+    {
+        size_t last_bin = std::lower_bound(sorted_thresholds.begin(), sorted_thresholds.end(), thresholds[i]) - sorted_thresholds.begin();
 
-    std::string src(ss.str());
+        for (size_t bin = 0; bin <= last_bin; ++bin)
+        {
+            iteration_infos[i*2] += histogram[bin];
+            iteration_infos[i*2 + 1] += histogram[sorted_thresholds.size() + 1 + bin];
+        }
+    }
 
-    cl::Program::Sources source(1, std::make_pair(src.c_str(), src.length()));
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Number of buffers allocated on devices since prepare()
+///////////////////////////////////////////////////////////////////////////////
+size_t VoxelColorer::get_number_of_device_allocations() const
+{
+    size_t result = 0;
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        result += ocl_slabs[i].session.get_number_of_allocations();
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Build voxel model of scene on host threads of this voxel colorer
+///////////////////////////////////////////////////////////////////////////////
+bool VoxelColorer::build_voxel_model_native(VoxelColorer & scene)
+{
+    std::cout << "Total number of hypotheses = " << scene.dimensions[0]*scene.dimensions[1]*scene.dimensions[2]*scene.number_of_images << std::endl;
+    std::cout << "Total number of voxels = " << scene.dimensions[0]*scene.dimensions[1]*scene.dimensions[2] << std::endl;
+
+    // colors are compared by metric of this voxel colorer, like in OpenCL
+    // programs it builds
+    NativeScene native_scene = scene.get_native_scene();
+    native_scene.color_metric = static_cast<NativeColorMetric>(color_metric);
 
-    program = cl::Program(ocl_context, source);
-    program.build(devices, "-cl-mad-enable");
+    native_backend.build_voxel_model(native_scene, scene.voxel_model.data());
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Build the opencl program for device of slab. Binary is taken from program
+//! cache if possible.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::build_program(DeviceSlab & slab, OpenCLProgram program)
+{
+    const EmbeddedFile * source = find_embedded_ocl_source(program_names[program]);
+
+    if ( !source )
+    {
+        std::cerr << "COVC: There is no embedded program " << program_names[program] << std::endl;
+        throw std::exception();
+    }
+
+    slab.programs[program] = program_cache.build(ocl_context, slab.device,
+                                                  std::string(reinterpret_cast<const char *>(source->data), source->size),
+                                                  get_program_build_options());
 
     return;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//! Build all opencl programs for every device
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::build_programs()
+{
+    // buffers are reserved for the kernels which are built, not for the
+    // current settings
+    ocl_chromaticities = precomputed_chromaticities;
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        for (size_t j = 0; j < NUMBER_OF_PROGRAMS; ++j)
+            build_program(ocl_slabs[i], static_cast<OpenCLProgram>(j));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Calculate bounding box and unprojection matrices of the scene before it
+//! is built
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::calculate_scene_parameters()
+{
+    calculate_bounding_box();
+    calculate_unprojection_matrices();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //! Calculate bounding box
 ///////////////////////////////////////////////////////////////////////////////
@@ -224,7 +499,7 @@ void VoxelColorer::calculate_bounding_box()
                                                        0.0f, 0.0f, 0.0f, 0.0f,
                                                        0.0f, 0.0f, 0.0f, 0.0f,
                                                        0.0f, 0.0f, 0.0f, 0.0f};
-        inverse(image_calibration_matrices[i].data(), inverted_image_calibration_matrix);
+        inverse(&image_calibration_matrices[i*16], inverted_image_calibration_matrix);
 
         float image_center_in_global_space[4] = {0.0f, 0.0f, 0.0f, 0.0f};
         multiply_matrix_vector(inverted_camera_calibration_matrix, image_center, image_center_in_global_space);
@@ -247,7 +522,7 @@ void VoxelColorer::calculate_bounding_box()
                                                        0.0f, 0.0f, 0.0f, 0.0f,
                                                        0.0f, 0.0f, 0.0f, 0.0f};
 
-        inverse(image_calibration_matrices[i].data(), inverted_image_calibration_matrix);
+        inverse(&image_calibration_matrices[i*16], inverted_image_calibration_matrix);
 
         float camera_pos[4] = {0.0f, 0.0f, 0.0f, 1.0f};
         multiply_matrix_vector(inverted_image_calibration_matrix, camera_pos, camera_pos);
@@ -342,7 +617,8 @@ void VoxelColorer::calculate_bounding_box()
 
 void VoxelColorer::calculate_projection_matrix()
 {
-    float * image_calibration_matrix = image_calibration_matrices[number_of_last_added_image].data();
+    float * image_calibration_matrix = &image_calibration_matrices[number_of_last_added_image*16];
+    float * projection_matrix = &projection_matrices[number_of_last_added_image*16];
     float unit_matrix[16] = {1.0f, 0.0f, 0.0f, 0.0f,
                              0.0f, 1.0f, 0.0f, 0.0f,
                              0.0f, 0.0f, 1.0f, 0.0f,
@@ -365,16 +641,166 @@ void VoxelColorer::calculate_projection_matrix()
     for (size_t i=0; i < 4; i++)
         for (size_t j=0; j < 4; j++)
         {
-        projection_matrices.at(number_of_last_added_image)[i*4 + j] = 0.0f;
+        projection_matrix[i*4 + j] = 0.0f;
         for (size_t k=0; k < 4; ++k)
-            projection_matrices.at(number_of_last_added_image)[i*4 + j] += temp_matrix[i*4 + k] * image_calibration_matrix[k*4 + j];
+            projection_matrix[i*4 + j] += temp_matrix[i*4 + k] * image_calibration_matrix[k*4 + j];
     }
 }
 
 void VoxelColorer::calculate_unprojection_matrices()
 {
     for (size_t i = 0; i < number_of_images; ++i)
-        inverse(projection_matrices.at(i).data(), unprojection_matrices.at(i).data());
+        inverse(&projection_matrices.at(i*16), &unprojection_matrices.at(i*16));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Split stacked voxel grids of the batch by z between devices in
+//! proportion to their scores. Every device gets at least one slice.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::calculate_slabs()
+{
+    double total_score = 0.0;
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        total_score += ocl_slabs[i].score;
+
+    double accumulated_score = 0.0;
+    size_t first_slice = 0;
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+    {
+        accumulated_score += ocl_slabs[i].score;
+
+        size_t number_of_next_slabs = ocl_slabs.size() - i - 1;
+        size_t last_slice = (size_t)floor((double)number_of_slices*accumulated_score/total_score + 0.5);
+
+        if (last_slice < first_slice + 1)
+            last_slice = first_slice + 1;
+        if (last_slice > number_of_slices - number_of_next_slabs)
+            last_slice = number_of_slices - number_of_next_slabs;
+
+        ocl_slabs[i].first_slice = first_slice;
+        ocl_slabs[i].last_slice = last_slice;
+
+        first_slice = last_slice;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Everything native backend needs to build this scene
+///////////////////////////////////////////////////////////////////////////////
+NativeScene VoxelColorer::get_native_scene() const
+{
+    NativeScene native_scene;
+    for (size_t i = 0; i < 3; ++i)
+        native_scene.dimensions[i] = dimensions[i];
+    native_scene.bounding_box = bounding_box;
+    native_scene.pixels = pixels.data();
+    native_scene.width = width;
+    native_scene.height = height;
+    native_scene.number_of_images = number_of_images;
+    native_scene.projection_matrices = projection_matrices.data();
+    native_scene.unprojection_matrices = unprojection_matrices.data();
+    native_scene.image_calibration_matrices = image_calibration_matrices.data();
+    native_scene.threshold = threshold;
+    native_scene.color_metric = static_cast<NativeColorMetric>(color_metric);
+
+    return native_scene;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Options programs are built with. Sizes shared with the host are defined
+//! by them, not copied into ocl/ programs. Programs precompiled at build time
+//! (COVC_PRECOMPILE_KERNELS) are built with program_build_options and these
+//! sizes only (COVC_OCL_BUILD_OPTIONS), other options make them to be
+//! compiled at run time.
+///////////////////////////////////////////////////////////////////////////////
+std::string VoxelColorer::get_program_build_options() const
+{
+    std::ostringstream options;
+
+    options << program_build_options
+            << " -D BRICK_SIZE=" << OpenCLSession::brick_size
+            << " -D MAX_VIEWS_OF_VOXEL=" << max_views_of_voxel;
+
+    if (precomputed_chromaticities)
+        options << " -D COVC_CHROMATICITIES";
+
+    options << color_metric_defines[color_metric];
+
+    return options.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Scenes of the same shape can be built in one batch
+///////////////////////////////////////////////////////////////////////////////
+bool VoxelColorer::has_same_shape(const VoxelColorer & scene) const
+{
+    return dimensions[0] == scene.dimensions[0] &&
+           dimensions[1] == scene.dimensions[1] &&
+           dimensions[2] == scene.dimensions[2] &&
+           number_of_images == scene.number_of_images &&
+           width == scene.width &&
+           height == scene.height &&
+           threshold == scene.threshold;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Every slab traced rays of images [first_image, first_image +
+//! images_per_launch) of every scene only through its own voxels. Take the
+//! nearest hit for every pixel and give the result to all slabs.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::merge_z_buffers(size_t first_image, size_t images_per_launch)
+{
+    const VoxelColorer & shape = *ocl_batch[0];
+    const size_t image_size = shape.width*shape.height;
+
+    // images of the launch of every scene
+    const size_t launch_size = images_per_launch*image_size;
+    const size_t batch_launch_size = ocl_batch.size()*launch_size;
+
+    slab_z_buffers.resize(ocl_slabs.size()*batch_launch_size);
+    slab_z_depths.resize(ocl_slabs.size()*batch_launch_size);
+    merged_z_buffer.resize(batch_launch_size);
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+    {
+        DeviceSlab & slab = ocl_slabs[i];
+
+        for (size_t j = 0; j < ocl_batch.size(); ++j)
+        {
+            const size_t offset = (j*shape.number_of_images + first_image)*image_size*sizeof(int);
+
+            enqueue_read_buffer(slab, slab.session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER),
+                                offset, launch_size*sizeof(int),
+                                &slab_z_buffers[i*batch_launch_size + j*launch_size]);
+            enqueue_read_buffer(slab, slab.session.get_buffer(OpenCLSession::BUFFER_Z_DEPTH),
+                                offset, launch_size*sizeof(int),
+                                &slab_z_depths[i*batch_launch_size + j*launch_size]);
+        }
+    }
+
+    wait_for_slabs();
+
+    for (size_t pixel = 0; pixel < batch_launch_size; ++pixel)
+    {
+        int depth = INT_MAX;
+        merged_z_buffer[pixel] = -1;
+
+        for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        {
+            if (slab_z_depths[i*batch_launch_size + pixel] < depth)
+            {
+                depth = slab_z_depths[i*batch_launch_size + pixel];
+                merged_z_buffer[pixel] = slab_z_buffers[i*batch_launch_size + pixel];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        for (size_t j = 0; j < ocl_batch.size(); ++j)
+            enqueue_write_buffer(ocl_slabs[i], ocl_slabs[i].session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER),
+                                 (j*shape.number_of_images + first_image)*image_size*sizeof(int), launch_size*sizeof(int),
+                                 &merged_z_buffer[j*launch_size]);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -382,8 +808,22 @@ void VoxelColorer::calculate_unprojection_matrices()
 ///////////////////////////////////////////////////////////////////////////////
 bool VoxelColorer::prepare()
 {
+    if (backend == BACKEND_NATIVE)
+    {
+        native_backend.prepare();
+        return true;
+    }
+
     if (!prepare_opencl())
-        return false;
+    {
+        if (backend == BACKEND_OPENCL)
+            return false;
+
+        std::cerr << "COVC: OpenCL is not available, native backend is used" << std::endl;
+
+        backend = BACKEND_NATIVE;
+        native_backend.prepare();
+    }
 
     return true;
 }
@@ -391,22 +831,67 @@ bool VoxelColorer::prepare()
 ///////////////////////////////////////////////////////////////////////////////
 //! Prepare opencl
 //!
+//! Context is created for the pinned devices or, if no device was pinned,
+//! for the device with the best score on any platform (GPU or CPU).
+//!
 //! @return true if opencl available and was prepared, false instread
 ///////////////////////////////////////////////////////////////////////////////
 bool VoxelColorer::prepare_opencl()
 {
     bool result = false;
 
+    release_staging();
+    ocl_slabs.clear();
+
     try
     {
-        std::vector<cl::Platform> platforms;
-        cl::Platform::get(&platforms);
+        std::vector<cl::Device> devices = pinned_devices;
+
+        if (devices.empty())
+        {
+            std::vector<OpenCLDevice> available_devices = get_opencl_devices();
+            if (available_devices.empty() || available_devices[0].score == 0.0)
+            {
+                std::cerr << "COVC: No OpenCL device able to run voxel colorer" << std::endl;
+                return false;
+            }
+
+            devices.push_back(available_devices[0].device);
+        }
+
+        // one context for all devices
+        cl_platform_id platform = devices[0].getInfo<CL_DEVICE_PLATFORM>();
+        for (size_t i = 0; i < devices.size(); ++i)
+        {
+            if (devices[i].getInfo<CL_DEVICE_PLATFORM>() != platform)
+            {
+                std::cerr << "COVC: All devices must belong to the same OpenCL platform" << std::endl;
+                return false;
+            }
+
+            std::cout << "COVC: Using " << devices[i].getInfo<CL_DEVICE_NAME>() << std::endl;
+        }
+
         cl_context_properties context_properties[] = {
-            CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platforms[0]()),
+            CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform),
             0
         };
 
-        ocl_context = cl::Context(CL_DEVICE_TYPE_GPU, &context_properties[0]);
+        ocl_context = cl::Context(devices, &context_properties[0]);
+
+        ocl_slabs.resize(devices.size());
+        for (size_t i = 0; i < devices.size(); ++i)
+        {
+            DeviceSlab & slab = ocl_slabs[i];
+
+            slab.device = devices[i];
+            slab.command_queue = cl::CommandQueue(ocl_context, slab.device);
+            slab.transfer_queue = cl::CommandQueue(ocl_context, slab.device);
+            slab.score = std::max(describe_opencl_device(slab.device).score, 1.0);
+            slab.first_slice = slab.last_slice = 0;
+        }
+
+        build_programs();
 
         result = true;
     }
@@ -415,294 +900,1033 @@ bool VoxelColorer::prepare_opencl()
         std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
         result = false;
     }
+    catch(std::exception)
+    {
+        result = false;
+    }
+
+    if (!result)
+        ocl_slabs.clear();
 
     return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//! Free staging memory of add_image() after its uploads are finished
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::release_staging()
+{
+    try
+    {
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (!ocl_staging_events[i].empty())
+                cl::Event::waitForEvents(ocl_staging_events[i]);
+            ocl_staging_events[i].clear();
+
+            if (ocl_staging_pointers[i])
+                ocl_slabs[0].transfer_queue.enqueueUnmapMemObject(ocl_staging_buffers[i], ocl_staging_pointers[i]);
+
+            ocl_staging_pointers[i] = 0;
+        }
+
+        if (!ocl_slabs.empty())
+            ocl_slabs[0].transfer_queue.finish();
+    }
+    catch(cl::Error ex)
+    {
+        std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
+    }
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        ocl_staging_buffers[i] = cl::Buffer();
+        ocl_staging_pointers[i] = 0;
+    }
+    ocl_staging_size = 0;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-//! step 1: for each voxel build variety of hypotheses
-//! HYPOTHESIS EXTRACTION
+//! Make batch the current one of OpenCL path: split it between slabs, take
+//! buffers from sessions and write parameters of scenes to them
+//!
+//! @return false if the batch can't be split between devices
 ///////////////////////////////////////////////////////////////////////////////
-void VoxelColorer::run_step_1(cl::Buffer & bounding_box_buffer,
-                              cl::Buffer & projection_matrices_buffer,
-                              cl::Buffer & hypotheses_buffer,
-                              cl::Buffer & dimensions_buffer)
+bool VoxelColorer::start_batch(const std::vector<VoxelColorer *> & batch)
 {
-    std::cout << "Run step 1..." << std::endl;
+    const VoxelColorer & shape = *batch[0];
 
-    // create opencl buffer for images
-    cl::Image3D images_buffer(ocl_context,
-                              CL_MEM_READ_ONLY,
-                              cl::ImageFormat(CL_ARGB, CL_UNSIGNED_INT8),
-                              width,
-                              height,
-                              number_of_images,
-                              width*4*sizeof(unsigned char),
-                              width*height*4*sizeof(unsigned char),
-                              pixels.data());
+    // step 1 takes all views from host or waits for their uploads
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (batch[i]->number_of_last_added_image != batch[i]->number_of_images)
+        {
+            std::cerr << "COVC: Only " << batch[i]->number_of_last_added_image << " of "
+                      << batch[i]->number_of_images << " images were added" << std::endl;
+            return false;
+        }
+    }
+
+    number_of_slices = shape.dimensions[2]*batch.size();
+
+    if (number_of_slices < ocl_slabs.size())
+    {
+        std::cerr << "COVC: Voxel grid has less slices by z than devices" << std::endl;
+        return false;
+    }
 
-    cl::Program ocl_program;
+    ocl_batch = batch;
 
-    build_program(ocl_program, "ocl/step_1_build_variety_of_hypotheses.cl");
+    // kernels take dimensions as uint
+    for (size_t i = 0; i < 3; ++i)
+        ocl_dimensions[i] = (cl_uint)shape.dimensions[i];
 
-    cl::Kernel ocl_kernel_step_1 = cl::Kernel(ocl_program, "build_variety_of_hypotheses");
-    ocl_kernel_step_1.setArg(0, bounding_box_buffer);
-    ocl_kernel_step_1.setArg(1, images_buffer);
-    ocl_kernel_step_1.setArg(2, projection_matrices_buffer);
-    ocl_kernel_step_1.setArg(3, hypotheses_buffer);
-    ocl_kernel_step_1.setArg(4, dimensions_buffer);
-    ocl_kernel_step_1.setArg(5, number_of_images);
+    calculate_slabs();
 
-    cl::KernelFunctor func_step_1 = ocl_kernel_step_1.bind(ocl_command_queue, cl::NDRange(dimensions[0], dimensions[1], dimensions[2]));
+    ///////////////////////////////////////////////////////////////////////////////
+    //! Take buffers from sessions. They are allocated only if the batch is
+    //! bigger than any batch built before.
+    ///////////////////////////////////////////////////////////////////////////////
+
+    const size_t matrices_size = shape.number_of_images*16*sizeof(float);
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+    {
+        DeviceSlab & slab = ocl_slabs[i];
+        OpenCLSession & session = slab.session;
+
+        session.reserve(ocl_context, shape.dimensions, batch.size(), shape.number_of_images, shape.width, shape.height,
+                        ocl_chromaticities);
+        slab.events.clear();
+
+        for (size_t j = 0; j < batch.size(); ++j)
+        {
+            const VoxelColorer & scene = *batch[j];
+
+            enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_BOUNDING_BOX),
+                                 j*sizeof(scene.bounding_box), sizeof(scene.bounding_box), scene.bounding_box);
+            enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_PROJECTION_MATRICES),
+                                 j*matrices_size, matrices_size, scene.projection_matrices.data());
+            enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_UNPROJECTION_MATRICES),
+                                 j*matrices_size, matrices_size, scene.unprojection_matrices.data());
+            enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_IMAGE_CALIBRATION_MATRICES),
+                                 j*matrices_size, matrices_size, scene.image_calibration_matrices.data());
+        }
 
-    func_step_1().wait();
+        enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS),
+                             0, sizeof(ocl_dimensions), ocl_dimensions);
+    }
 
-    ocl_command_queue.finish();
+    std::cout << "Number of scenes = " << batch.size() << std::endl;
+    std::cout << "Total number of hypotheses = " << shape.dimensions[0]*shape.dimensions[1]*number_of_slices*shape.number_of_images << std::endl;
+    std::cout << "Total number of voxels = " << shape.dimensions[0]*shape.dimensions[1]*number_of_slices << std::endl;
 
+    return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//! step 2: initial inconsistent voxels rejection
-//! CONSISTENCY CHECK AND HYPOTHESIS REMOVAL
+//! Copy image to pinned staging memory and upload it to image chunks of all
+//! slabs without waiting. Upload of an image runs while the caller prepares
+//! the next one, the host waits only for the upload from the same slot two
+//! images before.
+//!
+//! @return false if the image was not uploaded to all slabs
 ///////////////////////////////////////////////////////////////////////////////
-void VoxelColorer::run_step_2(cl::Buffer & hypotheses_buffer,
-                              cl::Buffer & dimensions_buffer,
-                              cl::KernelFunctor & func_step_2_3_first,
-                              cl::KernelFunctor & func_step_2_3_second,
-                              cl::Buffer & iteration_info_buffer,
-                              unsigned int * iteration_info)
+bool VoxelColorer::stream_image(const unsigned char * image)
 {
+    const size_t image_size = width*height*4*sizeof(unsigned char);
 
-    cl::Program ocl_program;
+    try
+    {
+        if (ocl_staging_size != image_size)
+        {
+            release_staging();
 
-    build_program(ocl_program, "ocl/step_2_initial_inconsistent_hypotheses_rejection_by_hypotheses.cl");
+            for (size_t i = 0; i < 2; ++i)
+            {
+                ocl_staging_buffers[i] = cl::Buffer(ocl_context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, image_size);
+                ocl_staging_pointers[i] = static_cast<unsigned char *>(
+                    ocl_slabs[0].transfer_queue.enqueueMapBuffer(ocl_staging_buffers[i], CL_TRUE, CL_MAP_WRITE, 0, image_size));
+            }
 
-    cl::Kernel ocl_kernel_step_2 = cl::Kernel(ocl_program, "initial_inconsistent_hypotheses_rejection");
+            ocl_staging_size = image_size;
+        }
 
-    std::cout << "Run step 2..." << std::endl;
+        size_t slot = number_of_last_added_image % 2;
+
+        if (!ocl_staging_events[slot].empty())
+            cl::Event::waitForEvents(ocl_staging_events[slot]);
+        ocl_staging_events[slot].clear();
+
+        memcpy(ocl_staging_pointers[slot], image, image_size);
+
+        for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        {
+            DeviceSlab & slab = ocl_slabs[i];
+            OpenCLSession & session = slab.session;
+
+            // grows nothing after the first image
+            session.reserve(ocl_context, dimensions, 1, number_of_images, width, height, ocl_chromaticities);
+
+            size_t chunk = session.get_chunk_of_image(number_of_last_added_image);
+
+            cl::size_t<3> origin;
+            origin[0] = origin[1] = 0;
+            origin[2] = number_of_last_added_image - session.get_first_image_of_chunk(chunk);
+            cl::size_t<3> region;
+            region[0] = width;
+            region[1] = height;
+            region[2] = 1;
+
+            cl::Event event;
+            slab.transfer_queue.enqueueWriteImage(session.get_image_chunk(chunk),
+                                                  CL_FALSE,
+                                                  origin,
+                                                  region,
+                                                  width*4*sizeof(unsigned char),
+                                                  image_size,
+                                                  ocl_staging_pointers[slot],
+                                                  NULL,
+                                                  &event);
+            slab.transfer_queue.flush();
+
+            slab.image_events.resize(number_of_images);
+            slab.image_events[number_of_last_added_image] = event;
+            ocl_staging_events[slot].push_back(event);
+        }
 
-    for (size_t x = 0; x < dimensions[0]; ++x)
+        images_on_devices = true;
+    }
+    catch(cl::Error ex)
     {
-        for (size_t y = 0; y < dimensions[1]; ++y)
+        std::cerr << "COVC: " << ex.what() << "(" << ex.error_code() << ": " << ex.error() << ")" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Enqueue kernel for voxels of slices [first_slice, last_slice) of stacked
+//! grid after all commands in events of slab. The kernel becomes the only
+//! command in them.
+//!
+//! @param items_per_voxel Number of work items by x for every voxel
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_kernel(DeviceSlab & slab, const cl::Kernel & kernel,
+                                  size_t first_slice, size_t last_slice,
+                                  size_t items_per_voxel, const cl::NDRange & local)
+{
+    if (first_slice == last_slice)
+        return;
+
+    cl::Event event;
+
+    slab.command_queue.enqueueNDRangeKernel(kernel,
+                                            cl::NDRange(0, 0, first_slice),
+                                            cl::NDRange(ocl_dimensions[0]*items_per_voxel, ocl_dimensions[1], last_slice - first_slice),
+                                            local,
+                                            slab.events.empty() ? NULL : &slab.events,
+                                            &event);
+
+    slab.events.assign(1, event);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Enqueue kernel after all commands in events of slab. The kernel becomes
+//! the only command in them.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_kernel(DeviceSlab & slab, const cl::Kernel & kernel,
+                                  const cl::NDRange & global, const cl::NDRange & local)
+{
+    cl::Event event;
+
+    slab.command_queue.enqueueNDRangeKernel(kernel,
+                                            cl::NullRange,
+                                            global,
+                                            local,
+                                            slab.events.empty() ? NULL : &slab.events,
+                                            &event);
+
+    slab.events.assign(1, event);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Read buffer after all commands in events of slab. Data is valid after
+//! wait_for_slabs().
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_read_buffer(DeviceSlab & slab, const cl::Buffer & buffer, size_t offset, size_t size, void * data)
+{
+    cl::Event event;
+
+    slab.command_queue.enqueueReadBuffer(buffer,
+                                         CL_FALSE,
+                                         offset,
+                                         size,
+                                         data,
+                                         slab.events.empty() ? NULL : &slab.events,
+                                         &event);
+
+    slab.events.assign(1, event);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Write buffer without waiting. Data must stay unchanged until the next
+//! kernel is finished. The write is added to events of slab, so writes
+//! issued one after another don't wait for each other.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_write_buffer(DeviceSlab & slab, const cl::Buffer & buffer, size_t offset, size_t size, const void * data)
+{
+    cl::Event event;
+
+    slab.command_queue.enqueueWriteBuffer(buffer,
+                                          CL_FALSE,
+                                          offset,
+                                          size,
+                                          data,
+                                          NULL,
+                                          &event);
+
+    slab.events.push_back(event);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Wait for all commands of all slabs. Apart from iteration info of step 3
+//! host waits for devices only here.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::wait_for_slabs()
+{
+    std::vector<cl::Event> events;
+
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+    {
+        ocl_slabs[i].command_queue.flush();
+        events.insert(events.end(), ocl_slabs[i].events.begin(), ocl_slabs[i].events.end());
+    }
+
+    if (!events.empty())
+        cl::Event::waitForEvents(events);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! step 1: for each voxel build variety of hypotheses
+//! HYPOTHESIS EXTRACTION
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::run_step_1()
+{
+    std::cout << "Run step 1..." << std::endl;
+
+    const VoxelColorer & shape = *ocl_batch[0];
+    const size_t image_size = shape.width*shape.height*4*sizeof(unsigned char);
+
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        OpenCLSession & session = slab.session;
+
+        size_t number_of_chunks = session.get_number_of_image_chunks();
+
+        // upload all chunks on transfer queue at once. every chunk is processed
+        // as soon as it is uploaded, while the next ones are still on the way.
+        // views of scenes follow each other, so a chunk may take views of
+        // several scenes
+        std::vector<std::vector<cl::Event> > chunks_written(number_of_chunks);
+        for (size_t i = 0; i < number_of_chunks; ++i)
         {
-            for (size_t z = 0; z < dimensions[2]; ++z)
-            {
-                // offset to hypothesis for voxel with coordinates [x][y][z]
-                ocl_kernel_step_2.setArg(0, hypotheses_buffer);
-                ocl_kernel_step_2.setArg(1, x);
-                ocl_kernel_step_2.setArg(2, y);
-                ocl_kernel_step_2.setArg(3, z);
-                ocl_kernel_step_2.setArg(4, dimensions_buffer);
-                ocl_kernel_step_2.setArg(5, threshold);
+            size_t first_image = session.get_first_image_of_chunk(i);
+            size_t last_image = first_image + session.get_number_of_images_in_chunk(i);
 
-                cl::KernelFunctor func_step_2 = ocl_kernel_step_2.bind(ocl_command_queue, cl::NDRange(number_of_images));
+            // add_image() has uploaded views already
+            if (ocl_batch[0]->images_on_devices)
+            {
+                chunks_written[i].assign(slab.image_events.begin() + first_image, slab.image_events.begin() + last_image);
+                continue;
+            }
 
-                func_step_2().wait();
+            for (size_t j = 0; j < ocl_batch.size(); ++j)
+            {
+                size_t first_view = std::max(first_image, j*shape.number_of_images);
+                size_t last_view = std::min(last_image, (j + 1)*shape.number_of_images);
+
+                if (first_view >= last_view)
+                    continue;
+
+                cl::size_t<3> origin;
+                origin[0] = origin[1] = 0;
+                origin[2] = first_view - first_image;
+                cl::size_t<3> region;
+                region[0] = shape.width;
+                region[1] = shape.height;
+                region[2] = last_view - first_view;
+
+                cl::Event event;
+                slab.transfer_queue.enqueueWriteImage(session.get_image_chunk(i),
+                                                      CL_FALSE,
+                                                      origin,
+                                                      region,
+                                                      shape.width*4*sizeof(unsigned char),
+                                                      image_size,
+                                                      &ocl_batch[j]->pixels[(first_view - j*shape.number_of_images)*image_size],
+                                                      NULL,
+                                                      &event);
+                chunks_written[i].push_back(event);
             }
         }
+        slab.transfer_queue.flush();
+
+        // voxels of other slabs are invisible for this device
+        cl::Kernel ocl_kernel_hide_voxels = cl::Kernel(slab.programs[PROGRAM_STEP_1], "hide_voxels");
+        ocl_kernel_hide_voxels.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_hide_voxels.setArg(1, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        ocl_kernel_hide_voxels.setArg(2, (cl_uint)shape.number_of_images);
+
+        enqueue_kernel(slab, ocl_kernel_hide_voxels, 0, slab.first_slice);
+        enqueue_kernel(slab, ocl_kernel_hide_voxels, slab.last_slice, number_of_slices);
+
+        cl::Kernel ocl_kernel_step_1 = cl::Kernel(slab.programs[PROGRAM_STEP_1], "build_variety_of_hypotheses");
+        ocl_kernel_step_1.setArg(0, session.get_buffer(OpenCLSession::BUFFER_BOUNDING_BOX));
+        ocl_kernel_step_1.setArg(2, session.get_buffer(OpenCLSession::BUFFER_PROJECTION_MATRICES));
+        ocl_kernel_step_1.setArg(3, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_step_1.setArg(4, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        ocl_kernel_step_1.setArg(5, (cl_uint)shape.number_of_images);
+        ocl_kernel_step_1.setArg(8, session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+
+        // chunks write different hypotheses, so they depend only on the
+        // commands before step 1 and on their own upload
+        std::vector<cl::Event> step_1_dependencies = slab.events;
+        std::vector<cl::Event> step_1_events;
+        for (size_t i = 0; i < number_of_chunks; ++i)
+        {
+            ocl_kernel_step_1.setArg(1, session.get_image_chunk(i));
+            ocl_kernel_step_1.setArg(6, (cl_uint)session.get_first_image_of_chunk(i));
+            ocl_kernel_step_1.setArg(7, (cl_uint)session.get_number_of_images_in_chunk(i));
+
+            slab.events = step_1_dependencies;
+            slab.events.insert(slab.events.end(), chunks_written[i].begin(), chunks_written[i].end());
+
+            enqueue_kernel(slab, ocl_kernel_step_1, slab.first_slice, slab.last_slice);
+
+            step_1_events.push_back(slab.events[0]);
+        }
+
+        slab.events.swap(step_1_events);
+        slab.command_queue.flush();
     }
+}
 
-    ocl_command_queue.finish();
+///////////////////////////////////////////////////////////////////////////////
+//! step 2: initial inconsistent voxels rejection
+//! CONSISTENCY CHECK AND HYPOTHESIS REMOVAL
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::run_step_2(unsigned int * iteration_info)
+{
+    std::cout << "Run step 2..." << std::endl;
+
+    const VoxelColorer & shape = *ocl_batch[0];
 
-    func_step_2_3_first().wait();
-    ocl_command_queue.finish();
-    func_step_2_3_second().wait();
-    ocl_command_queue.finish();
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+
+        // voxels are shared by work groups if their hypotheses fit into
+        // local memory
+        cl::Kernel ocl_kernel_step_2 = cl::Kernel(slab.programs[PROGRAM_STEP_2], "initial_inconsistent_hypotheses_rejection_local");
+        size_t voxels_per_work_group = get_voxels_per_work_group(ocl_kernel_step_2, slab.device,
+                                                                 shape.number_of_images, shape.dimensions[0]);
+        if (voxels_per_work_group != 0)
+            ocl_kernel_step_2.setArg(5, cl::__local(voxels_per_work_group*shape.number_of_images*4*sizeof(cl_float)));
+        else
+            ocl_kernel_step_2 = cl::Kernel(slab.programs[PROGRAM_STEP_2], "initial_inconsistent_hypotheses_rejection");
+
+        ocl_kernel_step_2.setArg(0, slab.session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_step_2.setArg(1, slab.session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        ocl_kernel_step_2.setArg(2, (cl_uint)shape.number_of_images);
+        ocl_kernel_step_2.setArg(3, shape.threshold);
+        ocl_kernel_step_2.setArg(4, slab.session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+
+        // all hypotheses of all voxels of the slab at once
+        if (voxels_per_work_group != 0)
+            enqueue_kernel(slab, ocl_kernel_step_2, slab.first_slice, slab.last_slice, shape.number_of_images,
+                           cl::NDRange(voxels_per_work_group*shape.number_of_images, 1, 1));
+        else
+            enqueue_kernel(slab, ocl_kernel_step_2, slab.first_slice, slab.last_slice, shape.number_of_images);
+
+        slab.command_queue.flush();
+    }
 
-    ocl_command_queue.enqueueReadBuffer(iteration_info_buffer,
-                                        CL_TRUE,
-                                        0,
-                                        sizeof(unsigned int)*2,
-                                        iteration_info);
+    run_step_2_3(iteration_info);
 
     std::cout << "Number of consistent hypotheses = " << iteration_info[0] << std::endl;
     std::cout << "Number of visible voxels = " << iteration_info[1] << std::endl;
 
     float float_iteration_info = iteration_info[0];
     //threshold = threshold/(float)(dimensions[0]*dimensions[1]*dimensions[2]*number_of_images);
-    std::cout << "threshold = " << threshold << std::endl;
+    std::cout << "threshold = " << shape.threshold << std::endl;
 
 }
 
-void VoxelColorer::build_step_2_3(cl::Buffer & hypotheses_buffer,
-                                  cl::Buffer & dimensions_buffer,
-                                  cl::Buffer & iteration_info_buffer,
-                                  cl::KernelFunctor & func_step_2_3_first,
-                                  cl::KernelFunctor & func_step_2_3_second)
+///////////////////////////////////////////////////////////////////////////////
+//! Enqueue compaction of visible voxels of list of slab into the other list.
+//! Size of the list is known only to device, kernels are run for
+//! max_visible_voxels of slab.
+//!
+//! @param list List of visible voxels, no_list - all voxels of slab. The
+//! result is written to list 0 then
+//! @param previous_iteration See enqueue_step_2_3()
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_compaction(DeviceSlab & slab, cl_uint list, cl_uint previous_iteration)
 {
-    cl::Program ocl_program;
-
-    build_program(ocl_program, "ocl/step_2_3_calculate_number_of_consistent_hypotheses_by_voxels.cl");
-
-    cl::Kernel ocl_kernel_step_2_3_first = cl::Kernel(ocl_program, "calculate_number_of_consistent_hypotheses_by_voxels");
-    ocl_kernel_step_2_3_first.setArg(0, hypotheses_buffer);
-    ocl_kernel_step_2_3_first.setArg(1, dimensions_buffer);
-    ocl_kernel_step_2_3_first.setArg(2, number_of_images);
+    const VoxelColorer & shape = *ocl_batch[0];
+    OpenCLSession & session = slab.session;
+
+    const size_t slice_size = shape.dimensions[0]*shape.dimensions[1];
+    const size_t number_of_voxels = (slab.last_slice - slab.first_slice)*slice_size;
+    const cl_uint output_list = list == no_list ? 0 : 1 - list;
+
+    cl::Kernel count_kernel = cl::Kernel(slab.programs[PROGRAM_COMPACTION], "count_visible_voxels");
+    cl::Kernel scan_kernel = cl::Kernel(slab.programs[PROGRAM_COMPACTION], "scan_visible_voxels");
+    cl::Kernel write_kernel = cl::Kernel(slab.programs[PROGRAM_COMPACTION], "write_visible_voxels");
+
+    // count and write passes must split candidates into the same work groups
+    size_t work_group_size = std::min(get_reduction_work_group_size(count_kernel, slab.device),
+                                      get_reduction_work_group_size(write_kernel, slab.device));
+    size_t scan_work_group_size = get_reduction_work_group_size(scan_kernel, slab.device);
+    size_t global_size = round_up_to_work_groups(slab.max_visible_voxels, work_group_size);
+
+    count_kernel.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+    count_kernel.setArg(1, (cl_uint)shape.number_of_images);
+    count_kernel.setArg(2, (cl_uint)(slab.first_slice*slice_size));
+    count_kernel.setArg(3, (cl_uint)number_of_voxels);
+    count_kernel.setArg(4, session.get_buffer(OpenCLSession::BUFFER_VISIBLE_VOXELS));
+    count_kernel.setArg(5, session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+    count_kernel.setArg(6, list);
+    count_kernel.setArg(7, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+    count_kernel.setArg(8, previous_iteration);
+    count_kernel.setArg(9, cl::__local(work_group_size*sizeof(cl_uint)));
+
+    scan_kernel.setArg(0, session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+    scan_kernel.setArg(1, output_list);
+    scan_kernel.setArg(2, (cl_uint)(global_size/work_group_size));
+    scan_kernel.setArg(3, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+    scan_kernel.setArg(4, previous_iteration);
+    scan_kernel.setArg(5, cl::__local(scan_work_group_size*sizeof(cl_uint)));
+
+    write_kernel.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+    write_kernel.setArg(1, (cl_uint)shape.number_of_images);
+    write_kernel.setArg(2, (cl_uint)(slab.first_slice*slice_size));
+    write_kernel.setArg(3, (cl_uint)number_of_voxels);
+    write_kernel.setArg(4, session.get_buffer(OpenCLSession::BUFFER_VISIBLE_VOXELS));
+    write_kernel.setArg(5, session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+    write_kernel.setArg(6, list);
+    write_kernel.setArg(7, output_list);
+    write_kernel.setArg(8, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+    write_kernel.setArg(9, previous_iteration);
+    write_kernel.setArg(10, cl::__local(work_group_size*sizeof(cl_uint)));
+
+    enqueue_kernel(slab, count_kernel, cl::NDRange(global_size), cl::NDRange(work_group_size));
+    enqueue_kernel(slab, scan_kernel, cl::NDRange(scan_work_group_size), cl::NDRange(scan_work_group_size));
+    enqueue_kernel(slab, write_kernel, cl::NDRange(global_size), cl::NDRange(work_group_size));
+}
 
-    func_step_2_3_first = ocl_kernel_step_2_3_first.bind(ocl_command_queue, cl::NDRange(dimensions[0], dimensions[1], dimensions[2]));
+///////////////////////////////////////////////////////////////////////////////
+//! Enqueue recount of consistent hypotheses of every visible voxel and
+//! computation of iteration info of every slab: number of consistent
+//! hypotheses, number of visible voxels and changed flag. Visible voxels
+//! left are compacted into the other list.
+//!
+//! @param iteration Slot of iteration info which receives the result
+//! @param previous_iteration Slot of the previous iteration, nothing is done
+//! if its changed flag is clear. no_previous_iteration - always done
+//! @param list List of visible voxels of every slab, no_list - all voxels
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_step_2_3(size_t iteration, cl_uint previous_iteration, cl_uint list)
+{
+    const VoxelColorer & shape = *ocl_batch[0];
+    const size_t iteration_info_size = OpenCLSession::iteration_info_size*sizeof(cl_uint);
 
-    build_program(ocl_program, "ocl/step_2_3_calculate_iteration_info.cl");
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        OpenCLSession & session = slab.session;
+
+        // only voxels of the slab are counted, other ones are invisible here
+        const size_t slice_size = shape.dimensions[0]*shape.dimensions[1];
+        const size_t number_of_voxels = (slab.last_slice - slab.first_slice)*slice_size;
+
+        cl::Kernel ocl_kernel_step_2_3 = cl::Kernel(slab.programs[PROGRAM_STEP_2_3], "calculate_iteration_info");
+        size_t work_group_size = get_reduction_work_group_size(ocl_kernel_step_2_3, slab.device);
+
+        ocl_kernel_step_2_3.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_step_2_3.setArg(1, (cl_uint)shape.number_of_images);
+        ocl_kernel_step_2_3.setArg(2, (cl_uint)(slab.first_slice*slice_size));
+        ocl_kernel_step_2_3.setArg(3, (cl_uint)number_of_voxels);
+        ocl_kernel_step_2_3.setArg(4, session.get_buffer(OpenCLSession::BUFFER_VISIBLE_VOXELS));
+        ocl_kernel_step_2_3.setArg(5, session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+        ocl_kernel_step_2_3.setArg(6, list);
+        ocl_kernel_step_2_3.setArg(7, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+        ocl_kernel_step_2_3.setArg(8, (cl_uint)iteration);
+        ocl_kernel_step_2_3.setArg(9, previous_iteration);
+        ocl_kernel_step_2_3.setArg(10, cl::__local(work_group_size*sizeof(cl_uint)));
+        ocl_kernel_step_2_3.setArg(11, cl::__local(work_group_size*sizeof(cl_uint)));
+
+        enqueue_write_buffer(slab, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO),
+                             iteration*iteration_info_size, iteration_info_size, zero_iteration_info);
+
+        enqueue_kernel(slab, ocl_kernel_step_2_3,
+                       cl::NDRange(round_up_to_work_groups(slab.max_visible_voxels, work_group_size)),
+                       cl::NDRange(work_group_size));
+
+        enqueue_compaction(slab, list, previous_iteration);
+    }
+}
 
-    cl::Kernel ocl_kernel_step_2_3_second = cl::Kernel(ocl_program, "calculate_iteration_info");
-    ocl_kernel_step_2_3_second.setArg(0, hypotheses_buffer);
-    ocl_kernel_step_2_3_second.setArg(1, dimensions_buffer);
-    ocl_kernel_step_2_3_second.setArg(2, number_of_images);
-    ocl_kernel_step_2_3_second.setArg(3, iteration_info_buffer);
+///////////////////////////////////////////////////////////////////////////////
+//! Enqueue update of occupancy of bricks of voxels of every slab, which
+//! lets rays of step 3 step over empty bricks.
+//!
+//! @param iteration Slot of iteration info of the iteration which carved
+//! voxels, nothing is done if its changed flag is clear and only occupied
+//! bricks are checked. no_previous_iteration - all bricks are checked
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::enqueue_occupancy(cl_uint iteration)
+{
+    const VoxelColorer & shape = *ocl_batch[0];
 
-    func_step_2_3_second = ocl_kernel_step_2_3_second.bind(ocl_command_queue, cl::NDRange(1));
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        OpenCLSession & session = slab.session;
+
+        cl::Kernel ocl_kernel_occupancy = cl::Kernel(slab.programs[PROGRAM_OCCUPANCY], "build_occupancy");
+        ocl_kernel_occupancy.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_occupancy.setArg(1, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        ocl_kernel_occupancy.setArg(2, (cl_uint)shape.number_of_images);
+        ocl_kernel_occupancy.setArg(3, session.get_buffer(OpenCLSession::BUFFER_OCCUPANCY));
+        ocl_kernel_occupancy.setArg(4, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+        ocl_kernel_occupancy.setArg(5, iteration);
+
+        enqueue_kernel(slab, ocl_kernel_occupancy,
+                       cl::NDRange(OpenCLSession::get_number_of_bricks(shape.dimensions)*ocl_batch.size()));
+    }
 }
 
-void VoxelColorer::build_clear_z_buffer(cl::Kernel & kernel)
+///////////////////////////////////////////////////////////////////////////////
+//! Recount consistent hypotheses of every voxel and compute iteration info:
+//! number of consistent hypotheses and number of visible voxels of all slabs
+//! and all scenes.
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::run_step_2_3(unsigned int * iteration_info)
 {
-    cl::Program ocl_program;
+    const size_t iteration_info_size = OpenCLSession::iteration_info_size;
 
-    build_program(ocl_program, "ocl/step_3_clear_z_buffer.cl");
+    std::vector<cl_uint> slab_iteration_info(ocl_slabs.size()*iteration_info_size);
 
-    kernel = cl::Kernel(ocl_program, "clear_z_buffer");
-}
+    // all voxels are recounted and the visible ones are listed
+    const size_t slice_size = ocl_batch[0]->dimensions[0]*ocl_batch[0]->dimensions[1];
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+        ocl_slabs[s].max_visible_voxels = (ocl_slabs[s].last_slice - ocl_slabs[s].first_slice)*slice_size;
 
-void VoxelColorer::clear_z_buffer(cl::Kernel &kernel, cl::Buffer &z_buffer)
-{
-    kernel.setArg(0, z_buffer);
-    cl::KernelFunctor func = kernel.bind(ocl_command_queue, cl::NDRange(number_of_images));
-    func().wait();
+    enqueue_step_2_3(0, no_previous_iteration, no_list);
+    enqueue_occupancy(no_previous_iteration);
+    ocl_visible_voxels_list = 0;
+
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+        enqueue_read_buffer(ocl_slabs[s], ocl_slabs[s].session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO),
+                            0, iteration_info_size*sizeof(cl_uint), &slab_iteration_info[s*iteration_info_size]);
+
+    // step 2 reports the result
+    wait_for_slabs();
+
+    iteration_info[0] = 0;
+    iteration_info[1] = 0;
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        iteration_info[0] += slab_iteration_info[s*iteration_info_size];
+        iteration_info[1] += slab_iteration_info[s*iteration_info_size + 1];
 
-    ocl_command_queue.finish();
+        // voxels are only hidden later, so kernels over the list are run
+        // for this number of voxels
+        ocl_slabs[s].max_visible_voxels = slab_iteration_info[s*iteration_info_size + 1];
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //! step 3: inconsistent hypotheses rejection. visibility buffer in use
+//!
+//! For every image rays are traced into z buffer first, then hypotheses of
+//! the voxels seen by pixels are checked. With several devices the z buffers
+//! of all slabs are merged in between. Images of all scenes are processed
+//! by the same launch, view is the third dimension.
+//!
+//! With batched views all images are traced by one launch and checked by
+//! the next one, rejections are applied after all views are checked. The
+//! result doesn't depend on order of views then.
+//!
+//! With consistency by voxels all images are traced by one launch as well,
+//! then every pixel marks its view in views of the voxel it sees and every
+//! visible voxel checks hypotheses of the marked views once, instead of once
+//! per pixel which sees it.
 ///////////////////////////////////////////////////////////////////////////////
-void VoxelColorer::run_step_3(cl::Buffer & hypotheses_buffer,
-                              cl::Buffer & bounding_box_buffer,
-                              cl::Buffer & dimensions_buffer,
-                              cl::Buffer & projection_matrices_buffer,
-                              cl::KernelFunctor & func_step_2_3_first,
-                              cl::KernelFunctor & func_step_2_3_second,
-                              cl::Buffer & iteration_info_buffer,
-                              unsigned int * iteration_info)
+void VoxelColorer::run_step_3(unsigned int * iteration_info)
 {
-    cl::Buffer image_calibration_matrices_buffer (ocl_context,
-                                                  CL_READ_ONLY_CACHE,
-                                                  number_of_images*16*sizeof(float));
+    const VoxelColorer & shape = *ocl_batch[0];
 
-    ocl_command_queue.enqueueWriteBuffer(image_calibration_matrices_buffer,
-                                         CL_TRUE,
-                                         0,
-                                         number_of_images*16*sizeof(float),
-                                         image_calibration_matrices.data());
+    std::vector<cl::Kernel> trace_kernels(ocl_slabs.size());
+    std::vector<cl::Kernel> rejection_kernels(ocl_slabs.size());
+    std::vector<cl::Kernel> apply_kernels(ocl_slabs.size());
+    std::vector<cl::Kernel> mark_views_kernels(ocl_slabs.size());
+    std::vector<cl::Kernel> voxel_consistency_kernels(ocl_slabs.size());
 
-    cl::Buffer unprojection_matrices_buffer (ocl_context,
-                                             CL_MEM_READ_ONLY,
-                                             number_of_images*16*sizeof(float));
+    const bool by_voxels = consistency_by_voxels && shape.number_of_images <= max_views_of_voxel;
+    if (consistency_by_voxels && !by_voxels)
+        std::cerr << "COVC: Consistency by voxels takes up to " << max_views_of_voxel
+                  << " images, it is checked by pixels" << std::endl;
 
-    ocl_command_queue.enqueueWriteBuffer(unprojection_matrices_buffer,
-                                         CL_TRUE,
-                                         0,
-                                         number_of_images*16*sizeof(float),
-                                         unprojection_matrices.data());
+    const size_t images_per_launch = (batched_views || by_voxels) ? shape.number_of_images : 1;
+    const cl::NDRange global_size(shape.width, shape.height, ocl_batch.size()*images_per_launch);
 
-    cl::Program ocl_program;
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        OpenCLSession & session = slab.session;
+
+        trace_kernels[s] = cl::Kernel(slab.programs[PROGRAM_STEP_3], "trace_z_buffer");
+        trace_kernels[s].setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        trace_kernels[s].setArg(1, session.get_buffer(OpenCLSession::BUFFER_BOUNDING_BOX));
+        trace_kernels[s].setArg(2, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        trace_kernels[s].setArg(3, session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER));
+        trace_kernels[s].setArg(4, session.get_buffer(OpenCLSession::BUFFER_Z_DEPTH));
+        trace_kernels[s].setArg(5, session.get_buffer(OpenCLSession::BUFFER_UNPROJECTION_MATRICES));
+        trace_kernels[s].setArg(6, session.get_buffer(OpenCLSession::BUFFER_IMAGE_CALIBRATION_MATRICES));
+        trace_kernels[s].setArg(8, (cl_uint)images_per_launch);
+        trace_kernels[s].setArg(9, (cl_uint)shape.number_of_images);
+        trace_kernels[s].setArg(10, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+        trace_kernels[s].setArg(13, session.get_buffer(OpenCLSession::BUFFER_OCCUPANCY));
+
+        rejection_kernels[s] = cl::Kernel(slab.programs[PROGRAM_STEP_3], "inconsistent_voxel_rejection");
+        rejection_kernels[s].setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        rejection_kernels[s].setArg(1, session.get_buffer(OpenCLSession::BUFFER_BOUNDING_BOX));
+        rejection_kernels[s].setArg(2, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        rejection_kernels[s].setArg(3, session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER));
+        rejection_kernels[s].setArg(4, session.get_buffer(OpenCLSession::BUFFER_PROJECTION_MATRICES));
+        rejection_kernels[s].setArg(6, (cl_uint)images_per_launch);
+        rejection_kernels[s].setArg(7, (cl_uint)shape.number_of_images);
+        rejection_kernels[s].setArg(8, shape.threshold);
+        rejection_kernels[s].setArg(9, (cl_uint)slab.first_slice);
+        rejection_kernels[s].setArg(10, (cl_uint)slab.last_slice);
+        rejection_kernels[s].setArg(11, session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+        rejection_kernels[s].setArg(12, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+        rejection_kernels[s].setArg(15, session.get_buffer(OpenCLSession::BUFFER_REJECTIONS));
+        rejection_kernels[s].setArg(16, (cl_uint)batched_views);
+
+        apply_kernels[s] = cl::Kernel(slab.programs[PROGRAM_STEP_3], "apply_rejections");
+        apply_kernels[s].setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        apply_kernels[s].setArg(1, session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER));
+        apply_kernels[s].setArg(2, session.get_buffer(OpenCLSession::BUFFER_REJECTIONS));
+        apply_kernels[s].setArg(3, (cl_uint)0);
+        apply_kernels[s].setArg(4, (cl_uint)images_per_launch);
+        apply_kernels[s].setArg(5, (cl_uint)shape.number_of_images);
+        apply_kernels[s].setArg(6, session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+        apply_kernels[s].setArg(7, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+
+        mark_views_kernels[s] = cl::Kernel(slab.programs[PROGRAM_STEP_3], "mark_views_of_voxels");
+        mark_views_kernels[s].setArg(0, session.get_buffer(OpenCLSession::BUFFER_Z_BUFFER));
+        mark_views_kernels[s].setArg(1, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        mark_views_kernels[s].setArg(2, (cl_uint)shape.number_of_images);
+        mark_views_kernels[s].setArg(3, (cl_uint)slab.first_slice);
+        mark_views_kernels[s].setArg(4, (cl_uint)slab.last_slice);
+        mark_views_kernels[s].setArg(5, session.get_buffer(OpenCLSession::BUFFER_VIEWS_OF_VOXELS));
+        mark_views_kernels[s].setArg(6, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+
+        voxel_consistency_kernels[s] = cl::Kernel(slab.programs[PROGRAM_STEP_3], "check_voxel_consistency");
+        voxel_consistency_kernels[s].setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        voxel_consistency_kernels[s].setArg(1, (cl_uint)shape.number_of_images);
+        voxel_consistency_kernels[s].setArg(2, shape.threshold);
+        voxel_consistency_kernels[s].setArg(3, (cl_uint)((slab.last_slice - slab.first_slice)*shape.dimensions[0]*shape.dimensions[1]));
+        voxel_consistency_kernels[s].setArg(4, session.get_buffer(OpenCLSession::BUFFER_VISIBLE_VOXELS));
+        voxel_consistency_kernels[s].setArg(5, session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+        voxel_consistency_kernels[s].setArg(7, session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+        voxel_consistency_kernels[s].setArg(8, session.get_buffer(OpenCLSession::BUFFER_VIEWS_OF_VOXELS));
+        voxel_consistency_kernels[s].setArg(9, session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO));
+
+        // views of voxels are cleared by the check of every iteration
+        if (by_voxels)
+        {
+            cl::Kernel clear_views_kernel(slab.programs[PROGRAM_STEP_3], "clear_views_of_voxels");
+            clear_views_kernel.setArg(0, session.get_buffer(OpenCLSession::BUFFER_VIEWS_OF_VOXELS));
+            enqueue_kernel(slab, clear_views_kernel, slab.first_slice, slab.last_slice);
+        }
+    }
 
-    build_program(ocl_program, "ocl/step_3_inconsistent_voxels_rejection.cl");
+    // iterations are enqueued ahead, so devices are not idle while host
+    // reads iteration info of the previous one. an iteration checks changed
+    // flag of the previous one on device and does nothing after convergence.
+    // voxels of a slab are changed by z buffers of other slabs, so with
+    // several slabs the flag of one slab says nothing and iterations are
+    // enqueued one by one
+    const size_t iterations_in_flight = ocl_slabs.size() > 1 ? 1 : OpenCLSession::max_iterations_in_flight;
+    const size_t iteration_info_size = OpenCLSession::iteration_info_size;
+
+    // iteration info of every slab of every iteration in flight, read into
+    // host memory. slots of one buffer are not mapped, later iterations
+    // write the other slots while the one of the oldest iteration is read
+    std::vector<cl_uint> read_iteration_infos(iterations_in_flight*ocl_slabs.size()*iteration_info_size);
+    std::vector<cl::Event> read_events(iterations_in_flight*ocl_slabs.size());
 
-    cl::Kernel ocl_kernel_step_3 = cl::Kernel(ocl_program, "inconsistent_voxel_rejection");
+    std::cout << "Run step 3..." << std::endl;
 
-    cl::Kernel clear_z_buffer_kernel;
-    build_clear_z_buffer(clear_z_buffer_kernel);
+    size_t number_of_enqueued_iterations = 0;
 
-    unsigned int old_number_of_consistent_hypotheses = UINT_MAX;
+    for (size_t iteration = 0; ; ++iteration)
+    {
+        for (; number_of_enqueued_iterations < iteration + iterations_in_flight; ++number_of_enqueued_iterations)
+        {
+            const size_t slot = number_of_enqueued_iterations % iterations_in_flight;
+            const cl_uint previous_slot = (number_of_enqueued_iterations == 0 || iterations_in_flight == 1) ?
+                                          no_previous_iteration :
+                                          (cl_uint)((number_of_enqueued_iterations - 1) % iterations_in_flight);
 
-    // create opencl buffer for z buffer
-    // z buffer element contain only one value: free or occupied
-    cl::Buffer z_buffer (ocl_context,
-                         CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                         width*height*number_of_images*4*sizeof(unsigned char));
+            // after the first iteration z buffers are kept and only rays
+            // which saw carved voxels are traced. z buffers of several slabs
+            // are merged, so they are traced anew by every iteration
+            const cl_uint incremental = number_of_enqueued_iterations != 0 && ocl_slabs.size() == 1;
 
-    std::cout << "Run step 3..." << std::endl;
+            // lists of visible voxels are used in turn
+            const cl_uint list = (cl_uint)(number_of_enqueued_iterations % OpenCLSession::number_of_lists);
 
-    while (iteration_info[0] != old_number_of_consistent_hypotheses)
-    {
-        old_number_of_consistent_hypotheses = iteration_info[0];
+            for (size_t s = 0; s < ocl_slabs.size(); ++s)
+            {
+                trace_kernels[s].setArg(11, previous_slot);
+                trace_kernels[s].setArg(12, incremental);
+                rejection_kernels[s].setArg(13, previous_slot);
+                rejection_kernels[s].setArg(14, incremental);
+                apply_kernels[s].setArg(8, previous_slot);
+                mark_views_kernels[s].setArg(7, previous_slot);
+                voxel_consistency_kernels[s].setArg(6, list);
+                voxel_consistency_kernels[s].setArg(10, previous_slot);
+                voxel_consistency_kernels[s].setArg(11, incremental);
+            }
+
+            // kernels are enqueued with current arguments, so changing image
+            // number doesn't affect launches which are still in the queue
+            for (size_t i = 0; i < shape.number_of_images; i += images_per_launch)
+            {
+                for (size_t s = 0; s < ocl_slabs.size(); ++s)
+                {
+                    trace_kernels[s].setArg(7, (cl_uint)i);
+                    enqueue_kernel(ocl_slabs[s], trace_kernels[s], global_size, cl::NDRange(64, 1, 1));
+                }
+
+                if (ocl_slabs.size() > 1)
+                    merge_z_buffers(i, images_per_launch);
+
+                for (size_t s = 0; s < ocl_slabs.size(); ++s)
+                {
+                    if (by_voxels)
+                    {
+                        enqueue_kernel(ocl_slabs[s], mark_views_kernels[s], global_size, cl::NDRange(64, 1, 1));
+
+                        // voxels of the list visible at start of iteration
+                        enqueue_kernel(ocl_slabs[s], voxel_consistency_kernels[s],
+                                       cl::NDRange(round_up_to_work_groups(ocl_slabs[s].max_visible_voxels, 64)),
+                                       cl::NDRange(64));
+                        continue;
+                    }
+
+                    rejection_kernels[s].setArg(5, (cl_uint)i);
+                    enqueue_kernel(ocl_slabs[s], rejection_kernels[s], global_size, cl::NDRange(64, 1, 1));
+
+                    if (batched_views)
+                        enqueue_kernel(ocl_slabs[s], apply_kernels[s], global_size, cl::NDRange(64, 1, 1));
+                }
+            }
 
-        // fill z buffer with non occupied values
-        clear_z_buffer(clear_z_buffer_kernel, z_buffer);
+            enqueue_step_2_3(slot, previous_slot, list);
 
-        std::cout << "Run step 3 next iteration..." << std::endl;
+            // bricks emptied by the iteration are skipped by the next one
+            enqueue_occupancy((cl_uint)slot);
 
-        for (size_t i = 0; i < number_of_images; ++i)
-        {
-            ocl_kernel_step_3.setArg(0, hypotheses_buffer);
-            ocl_kernel_step_3.setArg(1, bounding_box_buffer);
-            ocl_kernel_step_3.setArg(2, dimensions_buffer);
-            ocl_kernel_step_3.setArg(3, z_buffer);
-            ocl_kernel_step_3.setArg(4, projection_matrices_buffer);
-            ocl_kernel_step_3.setArg(5, unprojection_matrices_buffer);
-            ocl_kernel_step_3.setArg(6, image_calibration_matrices_buffer);
-            ocl_kernel_step_3.setArg(7, i);
-            ocl_kernel_step_3.setArg(8, number_of_images);
-            ocl_kernel_step_3.setArg(9, threshold);
-            ocl_kernel_step_3.setArg(10, step_size);
-
-            cl::KernelFunctor func_step_3 = ocl_kernel_step_3.bind(ocl_command_queue, cl::NDRange(width, height), cl::NDRange(64, 1));
-
-            func_step_3().wait();
-            ocl_command_queue.finish();
+            // host has consumed the slot of the oldest iteration before it
+            // is enqueued again
+            for (size_t s = 0; s < ocl_slabs.size(); ++s)
+            {
+                DeviceSlab & slab = ocl_slabs[s];
+                cl::Event & event = read_events[slot*ocl_slabs.size() + s];
+
+                slab.command_queue.enqueueReadBuffer(slab.session.get_buffer(OpenCLSession::BUFFER_ITERATION_INFO),
+                                                     CL_FALSE,
+                                                     slot*iteration_info_size*sizeof(cl_uint),
+                                                     iteration_info_size*sizeof(cl_uint),
+                                                     &read_iteration_infos[(slot*ocl_slabs.size() + s)*iteration_info_size],
+                                                     &slab.events,
+                                                     &event);
+
+                slab.events.assign(1, event);
+                slab.command_queue.flush();
+            }
         }
 
+        std::cout << "Run step 3 next iteration..." << std::endl;
 
-        std::cout << "Remove hypotheses and compute iteration info" << std::endl;
+        // wait for the oldest iteration only, the next ones keep devices busy
+        const size_t slot = iteration % iterations_in_flight;
+        std::vector<cl::Event> events(read_events.begin() + slot*ocl_slabs.size(),
+                                      read_events.begin() + (slot + 1)*ocl_slabs.size());
+        cl::Event::waitForEvents(events);
 
-        func_step_2_3_first().wait();
-        ocl_command_queue.finish();
-        func_step_2_3_second().wait();
-        ocl_command_queue.finish();
+        bool changed = false;
 
-        ocl_command_queue.enqueueReadBuffer(iteration_info_buffer,
-                                            CL_TRUE,
-                                            0,
-                                            sizeof(unsigned int)*2,
-                                            iteration_info);
+        iteration_info[0] = 0;
+        iteration_info[1] = 0;
+        for (size_t s = 0; s < ocl_slabs.size(); ++s)
+        {
+            const cl_uint * slab_iteration_info = &read_iteration_infos[(slot*ocl_slabs.size() + s)*iteration_info_size];
+
+            iteration_info[0] += slab_iteration_info[0];
+            iteration_info[1] += slab_iteration_info[1];
+            changed = changed || slab_iteration_info[2] != 0;
+        }
 
         std::cout << "Number of consistent hypotheses = " << iteration_info[0] << std::endl;
         std::cout << "Number of visible voxels = " << iteration_info[1] << std::endl;
+
+        if (!changed)
+        {
+            // iterations after this one changed nothing, their lists are not
+            // written. their reads into host memory are still in flight
+            ocl_visible_voxels_list = (cl_uint)((iteration + 1) % OpenCLSession::number_of_lists);
+            wait_for_slabs();
+            break;
+        }
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //! step 4: build voxel model from variety of hypotheses
 ///////////////////////////////////////////////////////////////////////////////
-void VoxelColorer::run_step_4(cl::Buffer & hypotheses_buffer,
-                              cl::Buffer & dimensions_buffer)
+void VoxelColorer::run_step_4()
 {
-    cl::Program ocl_program;
+    std::cout << "Run step 4..." << std::endl;
 
-    // create opencl buffer for resulting voxel model
-    cl::Buffer voxel_model_buffer (ocl_context,
-                                   CL_MEM_WRITE_ONLY,
-                                   dimensions[0]*dimensions[1]*dimensions[2]*4*sizeof(unsigned char));
+    const VoxelColorer & shape = *ocl_batch[0];
+    const size_t slice_size = shape.dimensions[0]*shape.dimensions[1]*4*sizeof(unsigned char);
 
-    build_program(ocl_program, "ocl/step_4_build_voxel_model_from_variety_of_hypotheses.cl");
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        cl::Buffer & voxel_model_buffer = slab.session.get_buffer(OpenCLSession::BUFFER_VOXEL_MODEL);
+
+        const size_t number_of_voxels = (slab.last_slice - slab.first_slice)*shape.dimensions[0]*shape.dimensions[1];
+        if (number_of_voxels == 0)
+            continue;
+
+        // only visible voxels are colored, the rest of the model is cleared
+        cl::Kernel ocl_kernel_clear = cl::Kernel(slab.programs[PROGRAM_STEP_4], "clear_voxel_model");
+        ocl_kernel_clear.setArg(0, voxel_model_buffer);
+        ocl_kernel_clear.setArg(1, (cl_uint)(slab.first_slice*shape.dimensions[0]*shape.dimensions[1]));
+
+        cl::Kernel ocl_kernel_step_4 = cl::Kernel(slab.programs[PROGRAM_STEP_4], "build_voxel_model");
+        ocl_kernel_step_4.setArg(0, slab.session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_step_4.setArg(1, voxel_model_buffer);
+        ocl_kernel_step_4.setArg(2, (cl_uint)shape.number_of_images);
+        ocl_kernel_step_4.setArg(3, (cl_uint)number_of_voxels);
+        ocl_kernel_step_4.setArg(4, slab.session.get_buffer(OpenCLSession::BUFFER_VISIBLE_VOXELS));
+        ocl_kernel_step_4.setArg(5, slab.session.get_buffer(OpenCLSession::BUFFER_LIST_SIZES));
+        ocl_kernel_step_4.setArg(6, ocl_visible_voxels_list);
+
+        enqueue_kernel(slab, ocl_kernel_clear, cl::NDRange(number_of_voxels));
+        enqueue_kernel(slab, ocl_kernel_step_4, cl::NDRange(std::max(slab.max_visible_voxels, (size_t)1)));
+
+        // every slab gives its own slices of voxel models
+        for (size_t j = 0; j < ocl_batch.size(); ++j)
+        {
+            size_t first_slice = std::max(slab.first_slice, j*shape.dimensions[2]);
+            size_t last_slice = std::min(slab.last_slice, (j + 1)*shape.dimensions[2]);
 
-    cl::Kernel ocl_kernel_step_4 = cl::Kernel(ocl_program, "build_voxel_model");
-    ocl_kernel_step_4.setArg(0, hypotheses_buffer);
-    ocl_kernel_step_4.setArg(1, voxel_model_buffer);
-    ocl_kernel_step_4.setArg(2, dimensions_buffer);
-    ocl_kernel_step_4.setArg(3, number_of_images);
+            if (first_slice >= last_slice)
+                continue;
 
-    std::cout << "Run step 4..." << std::endl;
+            enqueue_read_buffer(slab, voxel_model_buffer,
+                                first_slice*slice_size,
+                                (last_slice - first_slice)*slice_size,
+                                &ocl_batch[j]->voxel_model[(first_slice - j*shape.dimensions[2])*slice_size]);
+        }
+    }
+
+    wait_for_slabs();
+
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+        ocl_slabs[s].events.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Threshold sweep after step 1: histogram of hypotheses and voxels by the
+//! smallest of ascending thresholds which keeps them in step 2, see
+//! sweep_thresholds()
+//!
+//! @param histogram Receives thresholds.size() + 1 bins of hypotheses, then
+//! the same of voxels. The last bin is for those kept by no threshold
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::run_threshold_sweep(const std::vector<float> & thresholds, unsigned int * histogram)
+{
+    std::cout << "Run threshold sweep..." << std::endl;
+
+    const VoxelColorer & shape = *ocl_batch[0];
+    const size_t number_of_bins = 2*(thresholds.size() + 1);
+
+    std::vector<cl_uint> slab_histograms(ocl_slabs.size()*number_of_bins, 0);
+
+    // the sweep is not a part of usual build, so its buffers are not kept in
+    // sessions. they must live until the slabs are waited for
+    std::vector<cl::Buffer> threshold_buffers(ocl_slabs.size());
+    std::vector<cl::Buffer> histogram_buffers(ocl_slabs.size());
 
-    cl::KernelFunctor func_step_4 = ocl_kernel_step_4.bind(ocl_command_queue, cl::NDRange(dimensions[0], dimensions[1], dimensions[2]));
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        DeviceSlab & slab = ocl_slabs[s];
+        OpenCLSession & session = slab.session;
+
+        threshold_buffers[s] = cl::Buffer(ocl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                          thresholds.size()*sizeof(float), const_cast<float *>(thresholds.data()));
+        histogram_buffers[s] = cl::Buffer(ocl_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                          number_of_bins*sizeof(cl_uint), &slab_histograms[s*number_of_bins]);
+
+        cl::Kernel ocl_kernel_sweep = cl::Kernel(slab.programs[PROGRAM_STEP_2], "calculate_threshold_histogram");
+        ocl_kernel_sweep.setArg(0, session.get_buffer(OpenCLSession::BUFFER_HYPOTHESES));
+        ocl_kernel_sweep.setArg(1, session.get_buffer(OpenCLSession::BUFFER_DIMENSIONS));
+        ocl_kernel_sweep.setArg(2, (cl_uint)shape.number_of_images);
+        ocl_kernel_sweep.setArg(3, session.get_buffer(OpenCLSession::BUFFER_CHROMATICITIES));
+        ocl_kernel_sweep.setArg(4, threshold_buffers[s]);
+        ocl_kernel_sweep.setArg(5, (cl_uint)thresholds.size());
+        ocl_kernel_sweep.setArg(6, histogram_buffers[s]);
+
+        // work groups sum bins in local memory if they fit, many thresholds
+        // are counted by global atomics. local argument can't be empty
+        const cl_ulong local_memory_size = slab.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                                           ocl_kernel_sweep.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(slab.device);
+        const bool local_bins = number_of_bins*sizeof(cl_uint) <= local_memory_size;
+
+        if (!local_bins)
+            std::cerr << "COVC: " << thresholds.size() << " thresholds don't fit local memory, "
+                      << "the sweep is counted in global memory" << std::endl;
+
+        ocl_kernel_sweep.setArg(7, cl::__local(local_bins ? number_of_bins*sizeof(cl_uint) : sizeof(cl_uint)));
+        ocl_kernel_sweep.setArg(8, (cl_uint)local_bins);
+
+        enqueue_kernel(slab, ocl_kernel_sweep, slab.first_slice, slab.last_slice);
+
+        enqueue_read_buffer(slab, histogram_buffers[s], 0, number_of_bins*sizeof(cl_uint), &slab_histograms[s*number_of_bins]);
+    }
 
-    func_step_4().wait();
-    ocl_command_queue.finish();
+    wait_for_slabs();
+
+    for (size_t s = 0; s < ocl_slabs.size(); ++s)
+    {
+        ocl_slabs[s].events.clear();
 
-    ocl_command_queue.enqueueReadBuffer(voxel_model_buffer,
-                                        CL_TRUE,
-                                        0,
-                                        dimensions[0]*dimensions[1]*dimensions[2]*4*sizeof(unsigned char),
-                                        voxel_model.data());
+        for (size_t bin = 0; bin < number_of_bins; ++bin)
+            histogram[bin] += slab_histograms[s*number_of_bins + bin];
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -716,21 +1940,64 @@ void VoxelColorer::set_camera_calibration_matrix(const float *_camera_calibratio
         camera_calibration_matrix[i] = _camera_calibration_matrix[i];
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//! Pin OpenCL device. Takes effect on next prepare().
+//!
+//! @param device One of devices returned by get_devices()
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::set_device(const cl::Device & device)
+{
+    pinned_devices.assign(1, device);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Let prepare() choose the fastest available OpenCL device
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::set_device_auto()
+{
+    pinned_devices.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Pin several OpenCL devices of one platform. Takes effect on next
+//! prepare(). Voxel grid is split by z into slabs, one per device, in
+//! proportion to device scores.
+//!
+//! @param devices Devices returned by get_devices() or split_device_by_numa()
+///////////////////////////////////////////////////////////////////////////////
+void VoxelColorer::set_devices(const std::vector<cl::Device> & devices)
+{
+    pinned_devices = devices;
+}
+
 void VoxelColorer::set_number_of_images(size_t _number_of_images)
 {
     number_of_images = _number_of_images;
 
+    // images are kept on host or streamed to devices by add_image()
+    std::vector<unsigned char>().swap(pixels);
+    images_on_devices = false;
+    for (size_t i = 0; i < ocl_slabs.size(); ++i)
+        ocl_slabs[i].image_events.clear();
+
     // resize buffers
-    pixels.resize(number_of_images*512*512*4);
-    image_calibration_matrices.resize(number_of_images, std::vector<float>(16));
-    projection_matrices.resize(number_of_images, std::vector<float>(16));
-    unprojection_matrices.resize(number_of_images, std::vector<float>(16));
+    image_calibration_matrices.resize(number_of_images*16);
+    projection_matrices.resize(number_of_images*16);
+    unprojection_matrices.resize(number_of_images*16);
 
     number_of_last_added_image = 0;
 }
 
 void VoxelColorer::set_resulting_voxel_cube_dimensions (size_t dimension_x, size_t dimension_y, size_t dimension_z)
 {
+    // buffers of sessions are reserved by the first streamed image
+    if (images_on_devices)
+    {
+        std::cerr << "COVC: Voxel cube dimensions can't be changed while images are streamed to OpenCL devices, "
+                  << "set_number_of_images() starts over" << std::endl;
+        return;
+    }
+
     dimensions[0] = dimension_x;
     dimensions[1] = dimension_y;
     dimensions[2] = dimension_z;
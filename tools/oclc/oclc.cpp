@@ -22,10 +22,13 @@
 
 #include <fstream>
 #include <iostream>
+#include <string>
 using namespace std;
 
 #include <CL/cl.h>
 
+#include "programcache.h"
+
 ///////////////////////////////////////////////////////////////////////////////
 //! Global variables
 //
@@ -41,9 +44,13 @@ cl_program          ocl_program;
 ///////////////////////////////////////////////////////////////////////////////
 //! Functions definitions
 //
-int     build_source(const char *source, size_t source_length);
-char   *load_source(const char *filename, size_t &file_size);
+int     build_source(const char *source, size_t source_length, const char *options);
+void    clean();
+char   *load_source(const char *filename, size_t *file_size);
 int     prepare_opencl();
+int     prepare_opencl_for_device(cl_platform_id platform, cl_device_id device);
+int     build_for_all_devices(const char *source, size_t source_length, const char *options, const char *output_directory);
+int     write_binary(const char *source, size_t source_length, const char *options, const char *output_directory);
 //
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -54,8 +61,9 @@ int     prepare_opencl();
 //! @return 0 if succeeded, OpenCL error number otherwise
 //! @param source OpenCL source code
 //! @param source_length Source code length
+//! @param options Build options
 ///////////////////////////////////////////////////////////////////////////////
-int build_source(const char *source, size_t source_length)
+int build_source(const char *source, size_t source_length, const char *options)
 {
     cl_int ocl_error_number = CL_SUCCESS;
     ocl_program = clCreateProgramWithSource(ocl_context, 1, &source, &source_length, &ocl_error_number);
@@ -65,7 +73,7 @@ int build_source(const char *source, size_t source_length)
         return ocl_error_number;
     }
 
-    ocl_error_number = clBuildProgram(ocl_program, 1, &ocl_device_id, "-Werror", NULL, NULL);
+    ocl_error_number = clBuildProgram(ocl_program, 1, &ocl_device_id, options, NULL, NULL);
     if (ocl_error_number != CL_SUCCESS)
     {
         cout << "Error " << ocl_error_number << ": Failed to build program." << endl;
@@ -83,6 +91,87 @@ int build_source(const char *source, size_t source_length)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+//! Build source code for every device of every platform.
+//!
+//! @return 0 if program was built for at least one device, -1 otherwise
+//! @param source OpenCL source code
+//! @param source_length Source code length
+//! @param options Build options
+//! @param output_directory Directory for binaries, NULL - don't write them
+///////////////////////////////////////////////////////////////////////////////
+int build_for_all_devices(const char *source, size_t source_length, const char *options, const char *output_directory)
+{
+    cl_platform_id cl_platforms[16];
+    cl_uint number_of_platforms = 0;
+    int result = -1;
+
+    if (clGetPlatformIDs(16, cl_platforms, &number_of_platforms) != CL_SUCCESS)
+    {
+        cout << "Error: there are no OpenCL platforms!" << endl;
+        return -1;
+    }
+
+    for (cl_uint i = 0; i < number_of_platforms && i < 16; ++i)
+    {
+        cl_device_id devices[16];
+        cl_uint number_of_devices = 0;
+
+        if (clGetDeviceIDs(cl_platforms[i], CL_DEVICE_TYPE_ALL, 16, devices, &number_of_devices) != CL_SUCCESS)
+            continue;
+
+        for (cl_uint j = 0; j < number_of_devices && j < 16; ++j)
+        {
+            char device_name[256] = "";
+            clGetDeviceInfo(devices[j], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+            cout << "Device: " << device_name << endl;
+
+            // releases whatever was created before the failure
+            if (prepare_opencl_for_device(cl_platforms[i], devices[j]) != 0)
+            {
+                clean();
+                continue;
+            }
+
+            if (build_source(source, source_length, options) == 0 &&
+                (!output_directory || write_binary(source, source_length, options, output_directory) == 0))
+                result = 0;
+
+            clean();
+        }
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! Write binary of built program to directory as covc program cache entry,
+//! so covclib can take it instead of building the program.
+//!
+//! @return 0 if succeeded, -1 otherwise
+///////////////////////////////////////////////////////////////////////////////
+int write_binary(const char *source, size_t source_length, const char *options, const char *output_directory)
+{
+    try
+    {
+        // cl::Program releases program on destruction
+        clRetainProgram(ocl_program);
+        cl::Program program;
+        program() = ocl_program;
+
+        ProgramCache cache;
+        cache.set_directory(output_directory);
+        cache.store(cl::Device(ocl_device_id), string(source, source_length), options, program);
+    }
+    catch(cl::Error ex)
+    {
+        cout << "Error " << ex.error() << ": Failed to write binary (" << ex.what() << ")" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //! Clean up OpenCL resources
 ///////////////////////////////////////////////////////////////////////////////
@@ -90,15 +179,27 @@ void clean()
 {
     cl_int ocl_error_number = CL_SUCCESS;
 
-    clReleaseKernel(ocl_kernel);
-    clReleaseCommandQueue(ocl_command_queue);
-    clReleaseProgram(ocl_program);
+    if (ocl_kernel)
+        clReleaseKernel(ocl_kernel);
+    if (ocl_command_queue)
+        clReleaseCommandQueue(ocl_command_queue);
+    if (ocl_program)
+        clReleaseProgram(ocl_program);
+
+    ocl_kernel = NULL;
+    ocl_command_queue = NULL;
+    ocl_program = NULL;
+
+    if (!ocl_context)
+        return;
 
     ocl_error_number = clReleaseContext(ocl_context);
     if (ocl_error_number != CL_SUCCESS)
     {
         cout << "Error " << ocl_error_number << ": Can't release OpenCL context." << endl;
     }
+
+    ocl_context = NULL;
 }
 
 
@@ -132,7 +233,7 @@ char * load_source(const char *filename, size_t *file_size)
     {
         cout << "Error: can't read source code from file \'" << filename << "\'" << endl;
         fclose(source_file);
-        delete source_code;
+        delete [] source_code;
         return NULL;
     }
 
@@ -149,34 +250,108 @@ char * load_source(const char *filename, size_t *file_size)
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    bool all_devices = false;
+    const char * options = "-Werror";
+    const char * output_directory = NULL;
+    const char * filename = NULL;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string argument(argv[i]);
+
+        if (argument == "-a")
+            all_devices = true;
+        else if (argument == "-b" && i + 1 < argc)
+            options = argv[++i];
+        else if (argument == "-o" && i + 1 < argc)
+            output_directory = argv[++i];
+        else if (!filename)
+            filename = argv[i];
+        else
+            filename = NULL, i = argc;
+    }
+
+    if (!filename)
     {
         cout << "Invalid number of parameters." << endl;
         cout << "Usage:" << endl;
-        cout << "    " << argv[0] << " <filename>" << endl << endl;
+        cout << "    " << argv[0] << " [-a] [-b <options>] [-o <directory>] <filename>" << endl << endl;
         cout << "    Where <filename> is name of the file with OpenCL source code." << endl;
+        cout << "    -a              build for all OpenCL devices, not only the first GPU." << endl;
+        cout << "    -b <options>    build options, \"-Werror\" by default." << endl;
+        cout << "    -o <directory>  write built binaries to directory as covc program cache entries." << endl;
 
         return 0;
     }
 
-    // prepare opencl
-    if (prepare_opencl() != 0)
-        return -1;
-
     // load source code
     char * source_code = NULL;
     size_t source_length;
-    source_code = load_source(argv[1], &source_length);
+    source_code = load_source(filename, &source_length);
     if (!source_code)
         return -1;
 
-    // compile source code
-    build_source(source_code, source_length);
+    int result = 0;
+
+    if (all_devices)
+    {
+        result = build_for_all_devices(source_code, source_length, options, output_directory);
+    }
+    else
+    {
+        // prepare opencl
+        if (prepare_opencl() != 0)
+        {
+            delete [] source_code;
+            return -1;
+        }
+
+        // compile source code
+        result = build_source(source_code, source_length, options);
+        if (result == 0 && output_directory)
+            result = write_binary(source_code, source_length, options, output_directory);
+
+        // clean up resources
+        clean();
+    }
+
+    delete [] source_code;
+
+    return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//! Prepare for using given OpenCL device: create device context, command queue
+//!
+//! @return 0 if succeeded, OpenCL error otherwise
+///////////////////////////////////////////////////////////////////////////////
+int prepare_opencl_for_device(cl_platform_id platform, cl_device_id device)
+{
+    cl_int ocl_error_number = CL_SUCCESS;
+
+    cl_context_properties context_properties[] = {
+        CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform),
+        0
+    };
+
+    ocl_device_id = device;
+
+    ocl_context = clCreateContext(context_properties, 1, &ocl_device_id, NULL, NULL, &ocl_error_number);
+    if (ocl_error_number != CL_SUCCESS)
+    {
+        cout << "Error " << ocl_error_number << ": Failed to create OpenCL context!" << endl;
+        ocl_context = NULL;
+        return ocl_error_number;
+    }
 
-    // clean up resources
-    clean();
-    if (source_code)
-        delete source_code;
+    ocl_command_queue = clCreateCommandQueue(ocl_context, ocl_device_id, 0, &ocl_error_number);
+    if (ocl_error_number != CL_SUCCESS)
+    {
+        cout << "Error " << ocl_error_number << " in clCreateCommandQueue call!" << endl;
+        ocl_command_queue = NULL;
+        return ocl_error_number;
+    }
 
     return 0;
 }